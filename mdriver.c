@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE  /* for RUSAGE_THREAD */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,6 +16,9 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -31,7 +35,7 @@
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((size_t)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
@@ -46,11 +50,16 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    enum {ALLOC, FREE, REALLOC, MEMALIGN, CALLOC, GROUP} type; /* type of request */
     int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
+    size_t size;                      /* byte size of alloc/realloc request */
+    int align;                        /* alignment of memalign request */
+    int group;                        /* objects in the group starting here, 0 for the rest */
 } traceop_t;
 
+/* Most objects a single mm_malloc_group op in a trace can have */
+#define MAX_GROUP 16
+
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
@@ -60,6 +69,8 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    int teardown;        /* first op of the trailing run of frees */
+    void **batch;        /* room for the teardown ptrs (for mm_free_batch) */
 } trace_t;
 
 /* 
@@ -72,6 +83,15 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* Per-op latency of one run of a trace (-L) */
+typedef struct {
+    double p50;      /* median op latency in usecs */
+    double p99;      /* 99th percentile */
+    double p999;     /* 99.9th percentile */
+    double max;      /* slowest op */
+    double minflt;   /* page faults the driver's own thread took */
+} latency_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -81,6 +101,18 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double footprint;/* footprint in bytes at the end of the trace, after trimming */
+    double peak_heap;/* largest the heap got in the utilization pass */
+    double minflt;   /* minor page faults taken by the correctness pass */
+    double rss;      /* resident heap bytes at the end of the trace (with -p) ... */
+    double rss_purged;/* ... and after mm_purge */
+    double reallocs; /* number of realloc requests in the trace */
+    double avoided;  /* reallocs that fit in mm_usable_size (with -s) */
+    mem_stats_t mem; /* what mem_sbrk cost in the correctness pass */
+    double secs_huge;/* secs to run the trace on a huge page heap (with -H) */
+    double huge;     /* bytes of the heap backed by huge pages (with -H) */
+    latency_t lat;   /* per-op latency on a cold heap (with -L) ... */
+    latency_t lat_ahead; /* ... and with the prefault helper on (with -L and -A) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -92,6 +124,113 @@ int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
+/* Use mm_free_sized with the size the driver remembers (-z) */
+static int sized_free = 0;
+
+/* Free the trailing run of frees with one mm_free_batch call (-b) */
+static int batch_free = 0;
+
+/* Call mm_purge after each trace and report the heap's resident set (-p) */
+static int purge = 0;
+
+/* Exploit-slack realloc mode (-s) and its counters */
+static int exploit_slack = 0; /* skip reallocs that already fit in the block */
+static int slack_reallocs = 0;/* realloc requests seen */
+static int slack_avoided = 0; /* realloc requests skipped because of slack */
+
+/* Time each trace again on a heap backed by transparent huge pages (-H) */
+static int hugepages = 0;
+
+/* Prefault the heap before timing (-P), or time it cold (-C) */
+static int pages = MEM_PAGES_ASIS;
+
+/* Bytes the prefault helper keeps ahead of the brk (-A), 0 for no helper */
+static size_t ahead = 0;
+
+/* Time every op on a cold heap and report the latency tail (-L) */
+static int latency = 0;
+
+/* Run the contention benchmark with up to this many threads (-T), 0 for none */
+static int max_threads = 0;
+#define THREAD_OPS   100000  /* mallocs, frees and reallocs per thread */
+#define THREAD_SLOTS 64      /* blocks each thread juggles */
+#define THREAD_HEAP  (1<<20) /* heap limit per thread, so every arena has room */
+
+/* Blocks per thread cache bin (-c), -1 for mm.c's default */
+static int cache = -1;
+
+/* How many arenas (-N), 0 for mm.c's default, and how threads pick one */
+static int arena_count = 0;
+static int arena_mode = MM_ARENA_RR;
+
+/* Run the producer-consumer benchmark with up to this many pairs (-Q), 0 for none */
+static int max_pairs = 0;
+#define PC_RING 256          /* blocks in flight between a producer and its consumer */
+
+/* Compare per-CPU and thread caches with up to this many threads (-R), 0 for none */
+static int max_percpu = 0;
+
+/* A producer and consumer pair's ring of blocks */
+typedef struct {
+    char *ring[PC_RING];
+    size_t sizes[PC_RING];
+    unsigned int head;       /* blocks the producer put in, only it writes this */
+    unsigned int tail;       /* blocks the consumer took out, only it writes this */
+} pc_pair_t;
+
+/* What each side of a pair gets */
+typedef struct {
+    pc_pair_t *pair;
+    int producer;
+    unsigned int seed;
+} pc_arg_t;
+
+/* Grow the heap with mem_sbrk from up to this many threads at once (-G), 0 for none */
+static int max_growers = 0;
+#define GROW_CALLS 4096      /* mem_sbrk calls per thread, of 8 to 1024 bytes */
+
+/* What each growing thread gets, and the ranges it got back */
+typedef struct {
+    unsigned int seed;
+    char id;                 /* written over every byte of its ranges */
+    int calls;               /* mem_sbrk calls that succeeded */
+    char **lo;               /* where each range starts ... */
+    size_t *len;             /* ... and how long it is */
+} grow_arg_t;
+
+/* One range handed out by mem_sbrk, for sorting */
+typedef struct {
+    char *lo;
+    size_t len;
+    char id;
+} grow_range_t;
+
+/* 
+ * Named mem_sbrk cost profiles for -k (see mem_set_cost). The costs
+ * are rough guesses at each environment, in usecs per mem_sbrk call
+ * and per page the heap grows or shrinks by.
+ */
+typedef struct {
+    char *name;
+    double fixed_usecs;
+    double page_usecs;
+} cost_profile_t;
+static cost_profile_t cost_profiles[] = {
+    {"free",   0.0, 0.0},   /* the simulated heap as it's always been */
+    {"native", 0.5, 0.1},   /* a brk call and first-touch faults on bare metal */
+    {"cgroup", 2.0, 0.5},   /* plus memory cgroup charging for every page */
+    {"vm",     5.0, 2.0},   /* VM exits and nested page faults */
+    {NULL,     0.0, 0.0}
+};
+static char *cost_profile = NULL; /* profile name or "all" (-k), NULL for none */
+static int cost_spin = 0;         /* spin for the cost instead of adding it up */
+
+/* How memlib backs the heap (-m), and how big it can get (-M) */
+static int backend = MEM_MMAP;
+static size_t max_heap = MAX_HEAP;
+static size_t granule = 0;    /* commit granule for MEM_RESERVE, 0 is a page */
+static size_t contig = 0;     /* how far the heap grows in place (-S), 0 is all the way */
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -106,7 +245,7 @@ static char *default_tracefiles[] = {
  *********************/
 
 /* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size, 
+static int add_range(range_t **ranges, char *lo, size_t size, 
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
@@ -122,12 +261,34 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *footprint);
+static long minor_faults(void);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, latency_t *lat);
+static int compare_secs(const void *a, const void *b);
+static long thread_faults(void);
+static double op_now(void);
+static char *realloc_slack(char *oldp, size_t size);
+static void free_sized(char *p, size_t size);
+static void free_teardown(trace_t *trace);
+static int alloc_group(trace_t *trace, int i);
+static void eval_cost_profiles(int n, char **tracefiles, stats_t *stats);
+static void eval_threads(int max);
+static void eval_pairs(int max);
+static void eval_percpu(int max);
+static void eval_grow(int max);
+static int compare_ranges(const void *a, const void *b);
+static double run_threads(int n, void *(*fn)(void *), void *args, size_t size);
+static void thread_heap(int n);
+static void *bench_thread(void *arg);
+static void *pc_thread(void *arg);
+static void *grow_thread(void *arg);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
 static void usage(void);
+static int parse_size(char *arg, int shift, size_t *bytes);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
 static void app_error(char *msg);
@@ -137,8 +298,8 @@ static void app_error(char *msg);
  **************/
 int main(int argc, char **argv)
 {
-    int i;
-    char c;
+    int i, j;
+    char c, *p;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
@@ -158,7 +319,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:m:M:S:k:A:T:c:N:Q:R:G:hvVgalszbpHPCL")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -178,12 +339,133 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/') 
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
+        case 'm': /* Heap backend, mmap, reserve[:<KB>] or sys[:<KB>] */
+	    if (!strcmp(optarg, "mmap"))
+		backend = MEM_MMAP;
+	    else if (!strncmp(optarg, "reserve", 7) && 
+		     (optarg[7] == '\0' || optarg[7] == ':')) {
+		backend = MEM_RESERVE;
+		if (optarg[7] == ':')
+		    granule = (size_t)atoi(optarg + 8) * 1024;
+	    }
+	    else if (!strncmp(optarg, "sys", 3) && 
+		     (optarg[3] == '\0' || optarg[3] == ':')) {
+		backend = MEM_SYS;
+		if (optarg[3] == ':')
+		    granule = (size_t)atoi(optarg + 4) * 1024;
+	    }
+	    else {
+		usage();
+		exit(1);
+	    }
+	    break;
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 's': /* Skip reallocs that fit in mm_usable_size */
+            exploit_slack = 1;
+            break;
+        case 'z': /* Free with mm_free_sized */
+            sized_free = 1;
+            break;
+        case 'b': /* Free the teardown phase with mm_free_batch */
+            batch_free = 1;
+            break;
+        case 'p': /* Purge free pages after each trace */
+            purge = 1;
+            break;
+        case 'k': /* mem_sbrk cost profile, <profile|all>[:spin] */
+            cost_profile = strdup(optarg);
+            if ((p = strchr(cost_profile, ':')) != NULL) {
+		*p = '\0';
+		cost_spin = !strcmp(p + 1, "spin");
+	    }
+	    for (j = 0; cost_profiles[j].name != NULL; j++)
+		if (!strcmp(cost_profile, cost_profiles[j].name))
+		    break;
+	    if (cost_profiles[j].name == NULL && strcmp(cost_profile, "all")) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'M': /* Heap limit in MB */
+            if (parse_size(optarg, 20, &max_heap) < 0 || max_heap == 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'S': /* Heap grows in place for KB, then in segments */
+            if (parse_size(optarg, 10, &contig) < 0 || contig == 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'P': /* Prefault the heap so timed runs take no page faults */
+            pages = MEM_PAGES_WARM;
+            break;
+        case 'C': /* Give the heap's pages back before every run */
+            pages = MEM_PAGES_COLD;
+            break;
+        case 'A': /* Prefault helper stays KB ahead of the brk */
+            if (parse_size(optarg, 10, &ahead) < 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'L': /* Per-op latency on a cold heap */
+            latency = 1;
+            break;
+        case 'c': /* Blocks per thread cache bin, 0 for no caches */
+            if ((cache = atoi(optarg)) < 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'N': /* Arenas, <n>[:cpu] */
+	    arena_count = atoi(optarg);
+	    if ((p = strchr(optarg, ':')) != NULL) {
+		if (strcmp(p+1, "cpu")) {
+		    usage();
+		    exit(1);
+		}
+		arena_mode = MM_ARENA_CPU;
+	    }
+	    if (arena_count < 1 || arena_count > MM_ARENAS_MAX) {
+		usage();
+		exit(1);
+	    }
+	    mm_set_arenas(arena_count, arena_mode);
+            break;
+        case 'Q': /* Producer-consumer benchmark with up to this many pairs */
+            if ((max_pairs = atoi(optarg)) <= 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'G': /* Grow the heap from up to this many threads at once */
+            if ((max_growers = atoi(optarg)) <= 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'R': /* Per-CPU vs thread caches with up to this many threads */
+            if ((max_percpu = atoi(optarg)) <= 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'T': /* Contention benchmark with up to this many threads */
+            if ((max_threads = atoi(optarg)) <= 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'H': /* Compare throughput with transparent huge pages */
+            hugepages = 1;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -285,7 +567,13 @@ int main(int argc, char **argv)
 	unix_error("mm_stats calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
+    mem_set_backend(backend, granule);
+    mem_set_max_heap(max_heap);
+    mem_set_contig(contig);
+    mem_set_pages(pages);
     mem_init(); 
+    if (cache >= 0)
+	mm_set_cache(cache);
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
@@ -293,25 +581,145 @@ int main(int argc, char **argv)
 	mm_stats[i].ops = trace->num_ops;
 	if (verbose > 1)
 	    printf("Checking mm_malloc for correctness, ");
+	slack_reallocs = slack_avoided = 0;
+	mm_stats[i].minflt = minor_faults();
+	mem_reset_stats();
+	mem_set_timing(1);
 	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	mem_set_timing(0);
+	mem_get_stats(&mm_stats[i].mem);
+	mm_stats[i].minflt = minor_faults() - mm_stats[i].minflt;
+	mm_stats[i].reallocs = slack_reallocs;
+	mm_stats[i].avoided = slack_avoided;
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_stats[i].util = eval_mm_util(trace, i, &ranges, 
+					    &mm_stats[i].footprint);
+	    if (purge) {
+		mm_stats[i].rss = mem_resident();
+		mm_purge();
+		mm_stats[i].rss_purged = mem_resident();
+	    }
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
+	    mm_stats[i].peak_heap = mem_peak_heapsize();
+	    if (pages == MEM_PAGES_WARM)
+		mem_prefault(mm_stats[i].peak_heap);
 	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (latency) {
+		eval_mm_latency(trace, &mm_stats[i].lat);
+		if (ahead) {
+		    /* Only this run has the helper, it'd skew all the others */
+		    mem_set_ahead(ahead);
+		    eval_mm_latency(trace, &mm_stats[i].lat_ahead);
+		    mem_set_ahead(0);
+		}
+	    }
 	}
 	free_trace(trace);
     }
 
+    /* Time the valid traces again on a heap backed by huge pages */
+    if (hugepages) {
+	mem_deinit();
+	mem_set_hugepages(1);
+	mem_init();
+	for (i=0; i < num_tracefiles; i++) {
+	    if (!mm_stats[i].valid)
+		continue;
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    speed_params.trace = trace;
+	    speed_params.ranges = ranges;
+	    if (pages == MEM_PAGES_WARM)
+		mem_prefault(mm_stats[i].peak_heap);
+	    mm_stats[i].secs_huge = fsecs(eval_mm_speed, &speed_params);
+	    mm_stats[i].huge = mem_hugepage_bytes();
+	    free_trace(trace);
+	}
+	printf("\nThroughput without and with transparent huge pages:\n");
+	printf("%5s%10s%10s%10s\n", "trace", "Kops", "hugeKops", "hugeKB");
+	for (i=0; i < num_tracefiles; i++)
+	    if (mm_stats[i].valid)
+		printf("%2d%13.0f%10.0f%10.0f\n", i,
+		       (mm_stats[i].ops/1e3)/mm_stats[i].secs,
+		       (mm_stats[i].ops/1e3)/mm_stats[i].secs_huge,
+		       mm_stats[i].huge/1024);
+    }
+
+    /* Time the valid traces again under each mem_sbrk cost profile */
+    if (cost_profile != NULL)
+	eval_cost_profiles(num_tracefiles, tracefiles, mm_stats);
+
+    /* Hammer the allocator from several threads at once */
+    if (max_threads)
+	eval_threads(max_threads);
+
+    /* Hand blocks from one thread to another to free */
+    if (max_pairs)
+	eval_pairs(max_pairs);
+
+    /* Many more threads than CPUs, thread caches against per-CPU caches */
+    if (max_percpu)
+	eval_percpu(max_percpu);
+
+    /* Many threads in mem_sbrk at once */
+    if (max_growers)
+	eval_grow(max_growers);
+
     /* Display the mm results in a compact table */
     if (verbose) {
 	printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
+	if (purge) {
+	    printf("Resident heap before and after mm_purge:\n");
+	    printf("%5s%10s%10s\n", "trace", "rssKB", "purgedKB");
+	    for (i=0; i < num_tracefiles; i++)
+		printf("%2d%13.0f%10.0f\n", i, mm_stats[i].rss/1024,
+		       mm_stats[i].rss_purged/1024);
+	    printf("\n");
+	}
+	printf("mem_sbrk cost (%s heap):\n", backend == MEM_SYS ? "sys" :
+	       backend == MEM_RESERVE ? "reserve/commit" : "mmap");
+	printf("%5s%10s%10s%10s%12s%10s\n", "trace", "sbrks", "syscalls", 
+	       "usecs", "committedKB", "segments");
+	for (i=0; i < num_tracefiles; i++)
+	    printf("%2d%13ld%10ld%10.1f%12.0f%10ld\n", i, mm_stats[i].mem.sbrk_calls,
+		   mm_stats[i].mem.syscalls, mm_stats[i].mem.sbrk_secs*1e6,
+		   (double)mm_stats[i].mem.committed/1024, mm_stats[i].mem.segments);
+	printf("\n");
+	if (latency) {
+	    printf("Per-op latency in usecs on a cold heap%s:\n", 
+		   ahead ? ", without and with the prefault helper" : "");
+	    printf("%5s%8s%8s%8s%8s%8s", "trace", "p50", "p99", "p99.9", "max", "minflt");
+	    if (ahead)
+		printf("%8s%8s%8s%8s", "p99", "p99.9", "max", "minflt");
+	    printf("\n");
+	    for (i=0; i < num_tracefiles; i++) {
+		if (!mm_stats[i].valid)
+		    continue;
+		printf("%2d%11.2f%8.2f%8.2f%8.1f%8.0f", i, mm_stats[i].lat.p50, 
+		       mm_stats[i].lat.p99, mm_stats[i].lat.p999, 
+		       mm_stats[i].lat.max, mm_stats[i].lat.minflt);
+		if (ahead)
+		    printf("%8.2f%8.2f%8.1f%8.0f", mm_stats[i].lat_ahead.p99,
+			   mm_stats[i].lat_ahead.p999, mm_stats[i].lat_ahead.max,
+			   mm_stats[i].lat_ahead.minflt);
+		printf("\n");
+	    }
+	    printf("\n");
+	}
+	if (exploit_slack) {
+	    printf("Reallocs avoided by exploiting slack:\n");
+	    printf("%5s%10s%10s\n", "trace", "reallocs", "avoided");
+	    for (i=0; i < num_tracefiles; i++)
+		printf("%2d%13.0f%10.0f\n", i, mm_stats[i].reallocs,
+		       mm_stats[i].avoided);
+	    printf("\n");
+	}
     }
 
     /* 
@@ -378,7 +786,7 @@ int main(int argc, char **argv)
  *     size bytes at addr lo. After checking the block for correctness,
  *     we create a range struct for this block and add it to the range list. 
  */
-static int add_range(range_t **ranges, char *lo, int size, 
+static int add_range(range_t **ranges, char *lo, size_t size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
@@ -395,9 +803,11 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* 
+     * The payload must lie within the extent of the heap, or of one of 
+     * the mappings memlib made for large objects 
+     */
+    if (!mem_contains(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -477,7 +887,8 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, align, group;
+    size_t size;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -519,21 +930,46 @@ static trace_t *read_trace(char *tracedir, char *filename)
     index = 0;
     op_index = 0;
     while (fscanf(tracefile, "%s", type) != EOF) {
+	trace->ops[op_index].group = 0;
 	switch(type[0]) {
 	case 'a':
-	    fscanf(tracefile, "%u %u", &index, &size);
+	    fscanf(tracefile, "%u %zu", &index, &size);
 	    trace->ops[op_index].type = ALLOC;
 	    trace->ops[op_index].index = index;
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'r':
-	    fscanf(tracefile, "%u %u", &index, &size);
+	    fscanf(tracefile, "%u %zu", &index, &size);
 	    trace->ops[op_index].type = REALLOC;
 	    trace->ops[op_index].index = index;
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
+	case 'm':
+	    fscanf(tracefile, "%u %zu %u", &index, &size, &align);
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].align = align;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'c':
+	    fscanf(tracefile, "%u %zu", &index, &size);
+	    trace->ops[op_index].type = CALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'g':
+	    fscanf(tracefile, "%u %zu %u", &index, &size, &group);
+	    trace->ops[op_index].type = GROUP;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].group = group;
+	    assert(group <= MAX_GROUP);
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
@@ -550,6 +986,22 @@ static trace_t *read_trace(char *tracedir, char *filename)
     fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
+
+    /* A group's objects are the group op and the ones right after it */
+    for (op_index = 0; op_index < trace->num_ops; op_index++)
+	for (group = 1; group < trace->ops[op_index].group; group++)
+	    assert(op_index + group < trace->num_ops &&
+		   trace->ops[op_index + group].type == GROUP &&
+		   trace->ops[op_index + group].group == 0);
+
+    /* Find the teardown phase, the run of frees that ends the trace */
+    trace->teardown = trace->num_ops;
+    while (trace->teardown > 0 && 
+	   trace->ops[trace->teardown - 1].type == FREE)
+	trace->teardown--;
+    if ((trace->batch = (void **)malloc((trace->num_ops - trace->teardown + 1)
+					* sizeof(void *))) == NULL)
+	unix_error("malloc 5 failed in read_trace");
     
     return trace;
 }
@@ -563,6 +1015,7 @@ void free_trace(trace_t *trace)
     free(trace->ops);         /* free the three arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
+    free(trace->batch);
     free(trace);              /* and the trace record itself... */
 }
 
@@ -578,8 +1031,9 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 {
     int i, j;
     int index;
-    int size;
-    int oldsize;
+    size_t k;
+    size_t size;
+    size_t oldsize;
     char *newp;
     char *oldp;
     char *p;
@@ -599,12 +1053,28 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	index = trace->ops[i].index;
 	size = trace->ops[i].size;
 
+	/* With -b the teardown phase is a single mm_free_batch */
+	if (batch_free && i == trace->teardown) {
+	    for (j = i; j < trace->num_ops; j++)
+		remove_range(ranges, trace->blocks[trace->ops[j].index]);
+	    free_teardown(trace);
+	    break;
+	}
+
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
-
-	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
+
+	    /* Call the student's malloc (or memalign, or calloc) */
+	    if (trace->ops[i].type == MEMALIGN)
+		p = mm_memalign(trace->ops[i].align, size);
+	    else if (trace->ops[i].type == CALLOC)
+		p = mm_calloc(1, size);
+	    else
+		p = mm_malloc(size);
+	    if (p == NULL) {
 		malloc_error(tracenum, i, "mm_malloc failed.");
 		return 0;
 	    }
@@ -616,6 +1086,26 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
 		return 0;
+
+	    /* Memalign payloads must also honor the requested alignment */
+	    if (trace->ops[i].type == MEMALIGN &&
+		((unsigned long)p % trace->ops[i].align) != 0) {
+		sprintf(msg, "Payload address (%p) not aligned to %d bytes",
+			p, trace->ops[i].align);
+		malloc_error(tracenum, i, msg);
+		return 0;
+	    }
+
+	    /* Calloc payloads must come back zeroed */
+	    if (trace->ops[i].type == CALLOC) {
+		for (k = 0; k < size; k++) {
+		    if (p[k] != 0) {
+			malloc_error(tracenum, i, "mm_calloc did not zero "
+				     "the block");
+			return 0;
+		    }
+		}
+	    }
 	    
 	    /* ADDED: cgw
 	     * fill range with low byte of index.  This will be used later
@@ -633,7 +1123,8 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    /* Call the student's realloc */
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp, size)) == NULL) {
+	    slack_reallocs++;
+	    if ((newp = realloc_slack(oldp, size)) == NULL) {
 		malloc_error(tracenum, i, "mm_realloc failed.");
 		return 0;
 	    }
@@ -652,8 +1143,8 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     */
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
-	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	    for (k = 0; k < oldsize; k++) {
+	      if ((unsigned char)newp[k] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -671,7 +1162,28 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Remove region from list and call student's free function */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    free_sized(p, trace->block_sizes[index]);
+	    break;
+
+        case GROUP: /* mm_malloc_group */
+
+	    /* The group's first op allocates all of it */
+	    if (trace->ops[i].group == 0)
+		break;
+	    if (alloc_group(trace, i) < 0) {
+		malloc_error(tracenum, i, "mm_malloc_group failed.");
+		return 0;
+	    }
+
+	    /* Every object in it is checked, and filled, on its own */
+	    for (j = i; j < i + trace->ops[i].group; j++) {
+		index = trace->ops[j].index;
+		size = trace->ops[j].size;
+		p = trace->blocks[index];
+		if (add_range(ranges, p, size, tracenum, j) == 0)
+		    return 0;
+		memset(p, index & 0xFF, size);
+	    }
 	    break;
 
 	default:
@@ -689,19 +1201,21 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   peak footprint in bytes (heap plus large object mappings) while 
+ *   running the student's malloc package on the trace. mem_sbrk() lets
+ *   the students decrement the brk pointer, so brk is not the high water
+ *   mark of the heap anymore, mem_peak_footprint() is. The footprint left
+ *   at the end of the trace (after any trimming) is returned in *footprint.
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *footprint)
 {   
     int i;
     int index;
-    int size, newsize, oldsize;
-    int max_total_size = 0;
-    int total_size = 0;
+    size_t size, newsize, oldsize;
+    size_t max_total_size = 0;
+    size_t total_size = 0;
     char *p;
     char *newp, *oldp;
 
@@ -711,13 +1225,26 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	app_error("mm_init failed in eval_mm_util");
 
     for (i = 0;  i < trace->num_ops;  i++) {
+	if (batch_free && i == trace->teardown) {
+	    free_teardown(trace);
+	    break;
+	}
+
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if (trace->ops[i].type == MEMALIGN)
+		p = mm_memalign(trace->ops[i].align, size);
+	    else if (trace->ops[i].type == CALLOC)
+		p = mm_calloc(1, size);
+	    else
+		p = mm_malloc(size);
+	    if (p == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -739,7 +1266,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp,newsize)) == NULL)
+	    if ((newp = realloc_slack(oldp,newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
 
 	    /* Remember region and size */
@@ -760,7 +1287,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
-	    mm_free(p);
+	    free_sized(p, size);
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
@@ -768,13 +1295,24 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    break;
 
+        case GROUP: /* mm_malloc_group */
+	    if (trace->ops[i].group > 0 && alloc_group(trace, i) < 0)
+		app_error("mm_malloc_group failed in eval_mm_util");
+
+	    /* Each object counts when its own op comes up */
+	    total_size += trace->ops[i].size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    *footprint = (double)mem_footprint();
+    return ((double)max_total_size / (double)mem_peak_footprint());
 }
 
 
@@ -784,7 +1322,8 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
+    int i, index;
+    size_t size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
@@ -794,7 +1333,12 @@ static void eval_mm_speed(void *ptr)
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
+    for (i = 0;  i < trace->num_ops;  i++) {
+	if (batch_free && i == trace->teardown) {
+	    free_teardown(trace);
+	    break;
+	}
+
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
@@ -803,26 +1347,706 @@ static void eval_mm_speed(void *ptr)
             if ((p = mm_malloc(size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
+            if (sized_free)
+		trace->block_sizes[index] = size;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+		app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            if (sized_free)
+		trace->block_sizes[index] = size;
+            break;
+
+        case CALLOC: /* mm_calloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_calloc(1, size)) == NULL)
+		app_error("mm_calloc error in eval_mm_speed");
+            trace->blocks[index] = p;
+            if (sized_free)
+		trace->block_sizes[index] = size;
             break;
 
 	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL)
+            if (exploit_slack)
+		newp = realloc_slack(oldp, newsize);
+            else
+		newp = mm_realloc(oldp, newsize);
+            if (newp == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
             trace->blocks[index] = newp;
+            if (sized_free)
+		trace->block_sizes[index] = newsize;
             break;
 
         case FREE: /* mm_free */
             index = trace->ops[i].index;
             block = trace->blocks[index];
-            mm_free(block);
+            if (sized_free)
+		mm_free_sized(block, trace->block_sizes[index]);
+            else
+		mm_free(block);
+            break;
+
+        case GROUP: /* mm_malloc_group */
+            if (trace->ops[i].group > 0 && alloc_group(trace, i) < 0)
+		app_error("mm_malloc_group error in eval_mm_speed");
             break;
 
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
+    }
+}
+
+/*
+ * eval_mm_latency - Run the trace once on a cold heap, timing every op
+ *    on its own, and put the latency percentiles in *lat. Its pages are
+ *    dropped first, so growing the heap takes first touch page faults
+ *    unless the prefault helper got to them first. The faults counted
+ *    are only the ones the driver's own thread took, not the helper's.
+ *    With -b the teardown batch counts as one op. It has its own copy
+ *    of the trace loop so the clock reads stay out of eval_mm_speed.
+ */
+static void eval_mm_latency(trace_t *trace, latency_t *lat)
+{
+    int i, index, n = trace->num_ops;
+    size_t size, newsize;
+    char *p, *newp, *oldp, *block;
+    double *op_lat, start;
+    long faults;
+
+    if ((op_lat = (double *)calloc(n, sizeof(double))) == NULL)
+	unix_error("op_lat calloc in eval_mm_latency failed");
+
+    mem_set_pages(MEM_PAGES_COLD);
+    mem_reset_brk();
+    mem_set_pages(pages);
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_latency");
+
+    faults = thread_faults();
+    for (i = 0;  i < n;  i++) {
+	start = op_now();
+	if (batch_free && i == trace->teardown) {
+	    free_teardown(trace);
+	    op_lat[i] = op_now() - start;
+	    break;
+	}
+
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_malloc(size)) == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            if (sized_free)
+		trace->block_sizes[index] = size;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+		app_error("mm_memalign error in eval_mm_latency");
+            trace->blocks[index] = p;
+            if (sized_free)
+		trace->block_sizes[index] = size;
+            break;
+
+        case CALLOC: /* mm_calloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_calloc(1, size)) == NULL)
+		app_error("mm_calloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            if (sized_free)
+		trace->block_sizes[index] = size;
+            break;
+
+	case REALLOC: /* mm_realloc */
+	    index = trace->ops[i].index;
+            newsize = trace->ops[i].size;
+	    oldp = trace->blocks[index];
+            if (exploit_slack)
+		newp = realloc_slack(oldp, newsize);
+            else
+		newp = mm_realloc(oldp, newsize);
+            if (newp == NULL)
+		app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = newp;
+            if (sized_free)
+		trace->block_sizes[index] = newsize;
+            break;
+
+        case FREE: /* mm_free */
+            index = trace->ops[i].index;
+            block = trace->blocks[index];
+            if (sized_free)
+		mm_free_sized(block, trace->block_sizes[index]);
+            else
+		mm_free(block);
+            break;
+
+        case GROUP: /* mm_malloc_group */
+            if (trace->ops[i].group > 0 && alloc_group(trace, i) < 0)
+		app_error("mm_malloc_group error in eval_mm_latency");
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_valid");
+        }
+	op_lat[i] = op_now() - start;
+    }
+    lat->minflt = thread_faults() - faults;
+
+    qsort(op_lat, n, sizeof(double), compare_secs);
+    lat->p50 = op_lat[n/2] * 1e6;
+    lat->p99 = op_lat[(int)(n*0.99)] * 1e6;
+    lat->p999 = op_lat[(int)(n*0.999)] * 1e6;
+    lat->max = op_lat[n-1] * 1e6;
+    free(op_lat);
+}
+
+/*
+ * compare_secs - qsort comparison for op latencies, fastest first
+ */
+static int compare_secs(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * op_now - a timestamp in seconds, fine grained enough to time one op
+ */
+static double op_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * realloc_slack - Call mm_realloc, unless -s was given and the block
+ *    already has room for size bytes according to mm_usable_size, in
+ *    which case the caller can keep using it without a realloc.
+ */
+static char *realloc_slack(char *oldp, size_t size)
+{
+    if (exploit_slack && mm_usable_size(oldp) >= size) {
+	slack_avoided++;
+	return oldp;
+    }
+    return mm_realloc(oldp, size);
+}
+
+/*
+ * free_sized - Free p with mm_free_sized if -z was given, else with mm_free.
+ */
+static void free_sized(char *p, size_t size)
+{
+    if (sized_free)
+	mm_free_sized(p, size);
+    else
+	mm_free(p);
+}
+
+/*
+ * alloc_group - Allocate the objects of the group whose first op is op i
+ *    of the trace with one mm_malloc_group call, and remember them (and
+ *    their sizes) like single mallocs. Returns 0 on success, -1 if the 
+ *    group couldn't be allocated.
+ */
+static int alloc_group(trace_t *trace, int i)
+{
+    size_t sizes[MAX_GROUP];
+    void *ptrs[MAX_GROUP];
+    int j, n = trace->ops[i].group;
+
+    for (j = 0; j < n; j++)
+	sizes[j] = trace->ops[i+j].size;
+    if (mm_malloc_group(n, sizes, ptrs) < 0)
+	return -1;
+    for (j = 0; j < n; j++) {
+	trace->blocks[trace->ops[i+j].index] = ptrs[j];
+	trace->block_sizes[trace->ops[i+j].index] = sizes[j];
+    }
+    return 0;
+}
+
+/*
+ * free_teardown - Hand every block freed by the teardown phase of the
+ *    trace to mm_free_batch in one call.
+ */
+static void free_teardown(trace_t *trace)
+{
+    int i, n = 0;
+
+    for (i = trace->teardown; i < trace->num_ops; i++)
+	trace->batch[n++] = trace->blocks[trace->ops[i].index];
+    mm_free_batch(trace->batch, n);
+}
+
+/*
+ * eval_cost_profiles - Time each valid trace again under the mem_sbrk
+ *    cost profile given with -k (or all of them), and print the 
+ *    throughput under each. Unless -k asked for spinning, the cost of
+ *    one more run is added up by memlib and added to the measured time.
+ */
+static void eval_cost_profiles(int n, char **tracefiles, stats_t *stats)
+{
+    int i, j;
+    double secs;
+    trace_t *trace;
+    speed_t speed_params;
+    mem_stats_t mem;
+    double *kops;
+    int nprofiles = sizeof(cost_profiles)/sizeof(cost_profiles[0]) - 1;
+
+    if ((kops = (double *)calloc(nprofiles * n, sizeof(double))) == NULL)
+	unix_error("kops calloc in eval_cost_profiles failed");
+
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	trace = read_trace(tracedir, tracefiles[i]);
+	speed_params.trace = trace;
+	speed_params.ranges = NULL;
+	for (j = 0; j < nprofiles; j++) {
+	    if (strcmp(cost_profile, "all") && 
+		strcmp(cost_profile, cost_profiles[j].name))
+		continue;
+	    mem_set_cost(cost_profiles[j].fixed_usecs, 
+			 cost_profiles[j].page_usecs, cost_spin);
+	    secs = fsecs(eval_mm_speed, &speed_params);
+	    if (!cost_spin) {
+		mem_reset_stats();
+		eval_mm_speed(&speed_params);
+		mem_get_stats(&mem);
+		secs += mem.cost_secs;
+	    }
+	    kops[j*n + i] = (stats[i].ops/1e3)/secs;
+	}
+	free_trace(trace);
+    }
+    mem_set_cost(0, 0, 0);
+
+    printf("\nThroughput (Kops) under each mem_sbrk cost profile (%s):\n", 
+	   cost_spin ? "spun" : "simulated");
+    printf("%5s", "trace");
+    for (j = 0; j < nprofiles; j++)
+	if (!strcmp(cost_profile, "all") || 
+	    !strcmp(cost_profile, cost_profiles[j].name))
+	    printf("%10s", cost_profiles[j].name);
+    printf("\n");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	printf("%2d   ", i);
+	for (j = 0; j < nprofiles; j++)
+	    if (!strcmp(cost_profile, "all") || 
+		!strcmp(cost_profile, cost_profiles[j].name))
+		printf("%10.0f", kops[j*n + i]);
+	printf("\n");
+    }
+    free(kops);
+}
+
+/*
+ * eval_threads - Run the contention benchmark with 1, 2, 4, ... up to
+ *    max threads, once with a single mutex around every mm call
+ *    (MM_LOCK_GLOBAL), once with the per-size-class locks, once
+ *    more with the thread caches in front of those, and once with 
+ *    all that split into arenas (as many as -N asked for, or one per 
+ *    thread). Prints the total throughput of each, and how the last
+ *    one scales against a single thread.
+ */
+static void eval_threads(int max)
+{
+    int n;
+    double global, class, cached, arena, arena1 = 0;
+    unsigned int *seeds;
+
+    if ((seeds = (unsigned int *)calloc(max, sizeof(unsigned int))) == NULL)
+	unix_error("calloc in eval_threads failed");
+    for (n = 0; n < max; n++)
+	seeds[n] = n + 1;
+
+    printf("\nThroughput (Kops) with %d ops per thread, one lock vs per-class locks\n"
+	   "vs per-class locks and thread caches vs all that in %s arenas:\n", 
+	   THREAD_OPS, arena_count ? "-N" : "per-thread");
+    printf("%7s%10s%10s%10s%10s%8s\n", "threads", "global", "class", "cached",
+	   "arenas", "scale");
+    thread_heap(max);
+    for (n = 1; ; n = (n*2 > max && n < max) ? max : n*2) {
+	mm_set_cache(0);
+	mm_set_locking(MM_LOCK_GLOBAL);
+	global = run_threads(n, bench_thread, seeds, sizeof(unsigned int));
+	mm_set_locking(MM_LOCK_CLASS);
+	class = run_threads(n, bench_thread, seeds, sizeof(unsigned int));
+	mm_set_cache(cache >= 0 ? cache : MM_CACHE_DEFAULT);
+	cached = run_threads(n, bench_thread, seeds, sizeof(unsigned int));
+	mm_set_arenas(arena_count ? arena_count : n, arena_mode);
+	arena = run_threads(n, bench_thread, seeds, sizeof(unsigned int));
+	mm_set_arenas(1, arena_mode);
+	if (n == 1)
+	    arena1 = arena;
+	printf("%4d%13.0f%10.0f%10.0f%10.0f%8.2f\n", n, (n*THREAD_OPS/1e3)/global,
+	       (n*THREAD_OPS/1e3)/class, (n*THREAD_OPS/1e3)/cached,
+	       (n*THREAD_OPS/1e3)/arena, n*arena1/arena);
+	if (n >= max)
+	    break;
+    }
+    if (arena_count)
+	mm_set_arenas(arena_count, arena_mode);
+    free(seeds);
+}
+
+/*
+ * eval_pairs - Run the producer-consumer benchmark with 1, 2, 4, ... up
+ *    to max pairs, every thread in an arena of its own, so each free is 
+ *    a remote one. Once with the consumers freeing straight into the 
+ *    producers' arenas under their locks, and once through the remote 
+ *    free queues. The thread caches are off for both, or the locked run
+ *    would mostly be freeing into the consumers' caches. Prints the 
+ *    throughput of each, and how many blocks the queues held on average
+ *    when their arena took them.
+ */
+static void eval_pairs(int max)
+{
+    int n, i;
+    double locked, queued;
+    long frees, drains;
+    pc_arg_t *args;
+    pc_pair_t *pairs;
+
+    if ((args = (pc_arg_t *)calloc(2*max, sizeof(pc_arg_t))) == NULL ||
+	(pairs = (pc_pair_t *)calloc(max, sizeof(pc_pair_t))) == NULL)
+	unix_error("calloc in eval_pairs failed");
+
+    printf("\nProducer-consumer throughput (Kops) with %d blocks per pair, remote frees\n"
+	   "under the owner's locks vs on its remote free queue (no thread caches):\n",
+	   THREAD_OPS);
+    printf("%5s%10s%10s%10s\n", "pairs", "locked", "queued", "depth");
+    thread_heap(2*max);
+    mm_set_cache(0);
+    for (n = 1; ; n = (n*2 > max && n < max) ? max : n*2) {
+	mm_set_arenas(2*n, MM_ARENA_RR);
+	for (i = 0; i < 2*n; i++) {
+	    args[i].pair = &pairs[i/2];
+	    args[i].producer = (i % 2 == 0);
+	    args[i].seed = i + 1;
+	}
+	mm_set_remote(0);
+	memset(pairs, 0, n*sizeof(pc_pair_t));
+	locked = run_threads(2*n, pc_thread, args, sizeof(pc_arg_t));
+	mm_set_remote(1);
+	memset(pairs, 0, n*sizeof(pc_pair_t));
+	queued = run_threads(2*n, pc_thread, args, sizeof(pc_arg_t));
+	mm_remote_stats(&frees, &drains);
+	printf("%3d%12.0f%10.0f%10.1f\n", n, (2*n*THREAD_OPS/1e3)/locked,
+	       (2*n*THREAD_OPS/1e3)/queued, drains ? (double)frees/drains : 0.0);
+	if (n >= max)
+	    break;
+    }
+    mm_set_arenas(arena_count ? arena_count : 1, arena_mode);
+    mm_set_cache(cache >= 0 ? cache : MM_CACHE_DEFAULT);
+    free(args);
+    free(pairs);
+}
+
+/*
+ * eval_percpu - Run the contention benchmark with 1, 2, 4, ... up to
+ *    max threads (meant to be many more than there are CPUs), once with
+ *    the thread caches and once with the per-CPU caches in their place.
+ *    Prints the throughput of each and the peak footprint, which grows 
+ *    with the thread count for the thread caches but not the per-CPU ones.
+ *    Without rseq there are no per-CPU caches, and the second run only
+ *    has the per-class locks.
+ */
+static void eval_percpu(int max)
+{
+    int n;
+    double cached, percpu;
+    size_t cached_peak, percpu_peak;
+    unsigned int *seeds;
+
+    if ((seeds = (unsigned int *)calloc(max, sizeof(unsigned int))) == NULL)
+	unix_error("calloc in eval_percpu failed");
+    for (n = 0; n < max; n++)
+	seeds[n] = n + 1;
+
+    printf("\nThroughput (Kops) and peak footprint (KB) with %d ops per thread on %ld CPUs,\n"
+	   "thread caches vs %s:\n", THREAD_OPS, sysconf(_SC_NPROCESSORS_ONLN),
+	   mm_set_percpu(1) ? "per-CPU caches" : "per-class locks (no rseq in this build)");
+    printf("%7s%10s%10s%10s%10s\n", "threads", "cached", "peak", "percpu", "peak");
+    for (n = 1; ; n = (n*2 > max && n < max) ? max : n*2) {
+	mm_set_percpu(0);
+	mm_set_cache(cache >= 0 ? cache : MM_CACHE_DEFAULT);
+	cached = run_threads(n, bench_thread, seeds, sizeof(unsigned int));
+	cached_peak = mem_peak_footprint();
+	mm_set_percpu(1);
+	mm_set_cache(0);
+	percpu = run_threads(n, bench_thread, seeds, sizeof(unsigned int));
+	percpu_peak = mem_peak_footprint();
+	printf("%4d%13.0f%10lu%10.0f%10lu\n", n, (n*THREAD_OPS/1e3)/cached,
+	       (unsigned long)cached_peak/1024, (n*THREAD_OPS/1e3)/percpu,
+	       (unsigned long)percpu_peak/1024);
+	if (n >= max)
+	    break;
+    }
+    mm_set_percpu(0);
+    mm_set_cache(cache >= 0 ? cache : MM_CACHE_DEFAULT);
+    free(seeds);
+}
+
+/*
+ * eval_grow - Stress mem_sbrk with 1, 2, 4, ... up to max threads all
+ *    growing the heap at once, GROW_CALLS times each or until it runs
+ *    out. The heap may only grow in place up to half its limit for this,
+ *    so the threads that run out do it quietly.
+ *    Then every range handed out is checked: together they have to cover
+ *    the heap from the first one up to the brk, with no gaps or overlaps,
+ *    and each still holds its thread's id in every byte.
+ */
+static void eval_grow(int max)
+{
+    int n, i, j, k, total, ran_out;
+    double secs;
+    grow_arg_t *args;
+    grow_range_t *ranges;
+    char *p;
+
+    if ((args = (grow_arg_t *)calloc(max, sizeof(grow_arg_t))) == NULL ||
+	(ranges = (grow_range_t *)calloc((size_t)max*GROW_CALLS, 
+					 sizeof(grow_range_t))) == NULL)
+	unix_error("calloc in eval_grow failed");
+    for (i = 0; i < max; i++)
+	if ((args[i].lo = (char **)calloc(GROW_CALLS, sizeof(char *))) == NULL ||
+	    (args[i].len = (size_t *)calloc(GROW_CALLS, sizeof(size_t))) == NULL)
+	    unix_error("calloc in eval_grow failed");
+
+    printf("\nmem_sbrk from many threads at once, %d calls each (up to %lu KB):\n",
+	   GROW_CALLS, (unsigned long)max_heap/2/1024);
+    printf("%7s%10s%10s%10s%8s\n", "threads", "calls", "ran out", "Kcalls", "check");
+    mem_set_contig(max_heap/2);
+    for (n = 1; ; n = (n*2 > max && n < max) ? max : n*2) {
+	for (i = 0; i < n; i++) {
+	    args[i].seed = i + 1;
+	    args[i].id = (char)(i + 1);
+	    args[i].calls = 0;
+	}
+	secs = run_threads(n, grow_thread, args, sizeof(grow_arg_t));
+
+	/* Sort every range by address, then walk them up to the brk */
+	total = ran_out = 0;
+	for (i = 0; i < n; i++) {
+	    ran_out += (args[i].calls < GROW_CALLS);
+	    for (j = 0; j < args[i].calls; j++, total++) {
+		ranges[total].lo = args[i].lo[j];
+		ranges[total].len = args[i].len[j];
+		ranges[total].id = args[i].id;
+	    }
+	}
+	qsort(ranges, total, sizeof(grow_range_t), compare_ranges);
+	for (k = 0; k < total; k++) {
+	    if (k > 0 && ranges[k].lo != ranges[k-1].lo + ranges[k-1].len)
+		app_error("mem_sbrk left a gap or handed out a range twice");
+	    for (p = ranges[k].lo; p < ranges[k].lo + ranges[k].len; p++)
+		if (*p != ranges[k].id)
+		    app_error("mem_sbrk range overwritten by another thread");
+	}
+	if (total > 0 && 
+	    ranges[total-1].lo + ranges[total-1].len != (char *)mem_heap_hi() + 1)
+	    app_error("mem_sbrk's brk doesn't match the ranges it handed out");
+	printf("%4d%13d%10d%10.0f%8s\n", n, total, ran_out, (total/1e3)/secs, "ok");
+	if (n >= max)
+	    break;
+    }
+    mem_set_contig(contig);
+
+    for (i = 0; i < max; i++) {
+	free(args[i].lo);
+	free(args[i].len);
+    }
+    free(args);
+    free(ranges);
+}
+
+/*
+ * compare_ranges - qsort comparator, orders mem_sbrk ranges by address
+ */
+static int compare_ranges(const void *a, const void *b)
+{
+    char *x = ((grow_range_t *)a)->lo, *y = ((grow_range_t *)b)->lo;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * grow_thread - Grow the heap by 8 to 1024 bytes at a time with 
+ *    mem_sbrk, GROW_CALLS times or until it fails, write the thread's
+ *    id over every byte of each range, and remember where they were.
+ */
+static void *grow_thread(void *arg)
+{
+    grow_arg_t *a = (grow_arg_t *)arg;
+    size_t len;
+    char *p;
+
+    while (a->calls < GROW_CALLS) {
+	len = 8 * (1 + rand_r(&a->seed) % 128);
+	if ((p = mem_sbrk(len)) == (void *)-1)
+	    break;
+	memset(p, a->id, len);
+	a->lo[a->calls] = p;
+	a->len[a->calls] = len;
+	a->calls++;
+    }
+    return NULL;
+}
+
+/*
+ * pc_thread - One side of a producer-consumer pair. The producer 
+ *    mallocs THREAD_OPS blocks of 8 to 1024 bytes, tags their first and 
+ *    last byte, and hands them over in the pair's ring. The consumer
+ *    checks the tags and frees them.
+ */
+static void *pc_thread(void *arg)
+{
+    pc_arg_t *a = (pc_arg_t *)arg;
+    pc_pair_t *pair = a->pair;
+    unsigned int head, tail;
+    size_t size;
+    char *p;
+    int i;
+
+    for (i = 0; i < THREAD_OPS; i++) {
+	if (a->producer) {
+	    size = (size_t)8 << (rand_r(&a->seed) % 8);
+	    if ((p = mm_malloc(size)) == NULL)
+		app_error("mm_malloc failed in pc_thread");
+	    p[0] = p[size-1] = (char)i;
+	    head = pair->head;
+	    while (head - __atomic_load_n(&pair->tail, __ATOMIC_ACQUIRE) == PC_RING)
+		sched_yield();
+	    pair->ring[head % PC_RING] = p;
+	    pair->sizes[head % PC_RING] = size;
+	    __atomic_store_n(&pair->head, head + 1, __ATOMIC_RELEASE);
+	} else {
+	    tail = pair->tail;
+	    while (__atomic_load_n(&pair->head, __ATOMIC_ACQUIRE) == tail)
+		sched_yield();
+	    p = pair->ring[tail % PC_RING];
+	    size = pair->sizes[tail % PC_RING];
+	    if (p[0] != (char)i || p[size-1] != (char)i)
+		app_error("block overwritten in pc_thread");
+	    mm_free(p);
+	    __atomic_store_n(&pair->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+    }
+    return NULL;
+}
+
+/*
+ * run_threads - Start n threads running fn on a fresh heap, thread i
+ *    with args + i*size as its argument, wait for all of them, and 
+ *    return the wall clock secs it took.
+ */
+static double run_threads(int n, void *(*fn)(void *), void *args, size_t size)
+{
+    pthread_t *tids;
+    double start;
+    int i;
+
+    if ((tids = (pthread_t *)calloc(n, sizeof(pthread_t))) == NULL)
+	unix_error("calloc in run_threads failed");
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in run_threads.");
+
+    start = op_now();
+    for (i = 0; i < n; i++)
+	if (pthread_create(&tids[i], NULL, fn, (char *)args + i*size) != 0)
+	    unix_error("pthread_create in run_threads failed");
+    for (i = 0; i < n; i++)
+	pthread_join(tids[i], NULL);
+    start = op_now() - start;
+
+    free(tids);
+    return start;
+}
+
+/*
+ * thread_heap - Make sure the heap limit leaves THREAD_HEAP for each of
+ *    n threads, since every arena takes at least one heap segment of 
+ *    its own. Starts memlib over with a bigger limit if it doesn't.
+ */
+static void thread_heap(int n)
+{
+    if (max_heap >= (size_t)n * THREAD_HEAP)
+	return;
+    max_heap = (size_t)n * THREAD_HEAP;
+    mem_deinit();
+    mem_set_max_heap(max_heap);
+    mem_init();
+    if (mm_init() < 0)
+	app_error("mm_init failed in thread_heap.");
+}
+
+/*
+ * bench_thread - Juggle THREAD_SLOTS blocks of 8 to 1024 bytes:
+ *    malloc into an empty slot, otherwise free (or now and then realloc)
+ *    what's there. Every block carries its slot number in its first
+ *    and last byte, so two threads handed the same memory get caught.
+ */
+static void *bench_thread(void *arg)
+{
+    unsigned int seed = *(unsigned int *)arg;
+    char *slots[THREAD_SLOTS];
+    size_t sizes[THREAD_SLOTS];
+    int i, r, s;
+
+    memset(slots, 0, sizeof(slots));
+    for (i = 0; i < THREAD_OPS; i++) {
+	r = rand_r(&seed);
+	s = r % THREAD_SLOTS;
+	if (slots[s] != NULL) {
+	    if (slots[s][0] != (char)s || slots[s][sizes[s]-1] != (char)s)
+		app_error("block overwritten by another thread in bench_thread");
+	    if ((r >> 8) % 8 != 0) {
+		mm_free(slots[s]);
+		slots[s] = NULL;
+		continue;
+	    }
+	    sizes[s] = (size_t)8 << ((r >> 12) % 8);
+	    slots[s] = mm_realloc(slots[s], sizes[s]);
+	} else {
+	    sizes[s] = (size_t)8 << ((r >> 12) % 8);
+	    slots[s] = mm_malloc(sizes[s]);
+	}
+	if (slots[s] == NULL)
+	    app_error("mm_malloc failed in bench_thread");
+	slots[s][0] = slots[s][sizes[s]-1] = (char)s;
+    }
+    for (s = 0; s < THREAD_SLOTS; s++)
+	if (slots[s] != NULL)
+	    mm_free(slots[s]);
+    return NULL;
 }
 
 /*
@@ -833,13 +2057,15 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
-    int i, newsize;
+    int i;
+    size_t newsize;
     char *p, *newp, *oldp;
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
 
         case ALLOC: /* malloc */
+        case GROUP: /* no groups in libc, each object is a malloc */
 	    if ((p = malloc(trace->ops[i].size)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
@@ -847,6 +2073,23 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    trace->blocks[trace->ops[i].index] = p;
 	    break;
 
+        case MEMALIGN: /* posix_memalign */
+	    if (posix_memalign((void **)&p, trace->ops[i].align,
+			       trace->ops[i].size) != 0) {
+		malloc_error(tracenum, i, "libc posix_memalign failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
+        case CALLOC: /* calloc */
+	    if ((p = calloc(1, trace->ops[i].size)) == NULL) {
+		malloc_error(tracenum, i, "libc calloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[trace->ops[i].index];
@@ -877,13 +2120,15 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 static void eval_libc_speed(void *ptr)
 {
     int i;
-    int index, size, newsize;
+    int index;
+    size_t size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
+        case GROUP: /* no groups in libc, each object is a malloc */
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 	    if ((p = malloc(size)) == NULL)
@@ -891,6 +2136,22 @@ static void eval_libc_speed(void *ptr)
 	    trace->blocks[index] = p;
 	    break;
 
+        case MEMALIGN: /* posix_memalign */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    if (posix_memalign((void **)&p, trace->ops[i].align, size) != 0)
+		unix_error("posix_memalign failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
+        case CALLOC: /* calloc */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    if ((p = calloc(1, size)) == NULL)
+		unix_error("calloc failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
@@ -926,17 +2187,19 @@ static void printresults(int n, stats_t *stats)
     double util = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%8s%10s%6s%8s%8s\n", 
+	   "trace", " valid", "util", "ops", "secs", "Kops", "endKB", "minflt");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f%8.0f%8.0f\n", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
-		   (stats[i].ops/1e3)/stats[i].secs);
+		   (stats[i].ops/1e3)/stats[i].secs,
+		   stats[i].footprint/1024,
+		   stats[i].minflt);
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
@@ -972,6 +2235,32 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * minor_faults - Return the number of minor page faults the process has
+ *     taken so far, according to getrusage
+ */
+static long minor_faults(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+	unix_error("getrusage failed in minor_faults");
+    return usage.ru_minflt;
+}
+
+/*
+ * thread_faults - Return the number of minor page faults the calling 
+ *     thread has taken so far (the prefault helper's don't count)
+ */
+static long thread_faults(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_THREAD, &usage) < 0)
+	unix_error("getrusage failed in thread_faults");
+    return usage.ru_minflt;
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -999,19 +2288,65 @@ void malloc_error(int tracenum, int opnum, char *msg)
     printf("ERROR [trace %d, line %d]: %s\n", tracenum, LINENUM(opnum), msg);
 }
 
+/*
+ * parse_size - Convert a command line count of KB (shift 10) or MB
+ *    (shift 20) to bytes in *bytes. Returns -1 if arg isn't a number,
+ *    or if the byte count doesn't fit in a size_t.
+ */
+static int parse_size(char *arg, int shift, size_t *bytes)
+{
+    unsigned long n;
+    char *end;
+
+    errno = 0;
+    n = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' ||
+	n > ((size_t)-1 >> shift))
+	return -1;
+    *bytes = (size_t)n << shift;
+    return 0;
+}
+
 /* 
  * usage - Explain the command line arguments
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValszbpHPCL] [-f <file>] [-t <dir>] [-m <backend>]\n"
+	    "               [-M <MB>] [-S <KB>] [-k <profile>] [-A <KB>] [-T <n>]\n"
+	    "               [-c <n>] [-N <n>[:cpu]] [-Q <n>] [-R <n>] [-G <n>]\n");
     fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-A <KB>    With -L, also time with <KB> above the brk prefaulted\n");
+    fprintf(stderr, "\t           by a helper thread.\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-b         Free the final run of frees with mm_free_batch.\n");
+    fprintf(stderr, "\t-c <n>     Thread cache bins hold <n> blocks (0 turns them off).\n");
+    fprintf(stderr, "\t-C         Time with cold pages (dropped before every run).\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
+    fprintf(stderr, "\t-G <n>     Stress mem_sbrk with up to <n> threads growing the heap.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H         Time traces again with transparent huge pages.\n");
+    fprintf(stderr, "\t-k <p>     Time traces under mem_sbrk cost profile <p> (free,\n");
+    fprintf(stderr, "\t           native, cgroup, vm or all), add :spin to spin.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Report per-op latency on a cold heap (with and\n");
+    fprintf(stderr, "\t           without the -A helper).\n");
+    fprintf(stderr, "\t-m <b>     Back the heap with mmap (default) or\n");
+    fprintf(stderr, "\t           reserve[:<KB>] (commit in KB granules), or\n");
+    fprintf(stderr, "\t           sys[:<KB>] (real mmap/munmap per KB granule).\n");
+    fprintf(stderr, "\t-M <MB>    Let the heap grow to <MB> megabytes.\n");
+    fprintf(stderr, "\t-N <n>     Split the free lists into <n> arenas, handed to threads\n");
+    fprintf(stderr, "\t           round-robin, or by CPU with :cpu.\n");
+    fprintf(stderr, "\t-P         Prefault the heap before timing.\n");
+    fprintf(stderr, "\t-p         Purge free pages after each trace, report RSS.\n");
+    fprintf(stderr, "\t-Q <n>     Run the producer-consumer benchmark with up to <n> pairs.\n");
+    fprintf(stderr, "\t-R <n>     Compare per-CPU and thread caches with up to <n> threads.\n");
+    fprintf(stderr, "\t-s         Skip reallocs that fit in mm_usable_size.\n");
+    fprintf(stderr, "\t-S <KB>    Grow the heap in place for <KB>, then in segments.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Run the contention benchmark with up to <n> threads.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
+    fprintf(stderr, "\t-z         Free with mm_free_sized.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE          /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,28 +11,270 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "memlib.h"
 #include "config.h"
 
+#define HUGEPAGE_SIZE (2*(1<<20))  /* transparent huge page size on x86 */
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_fresh_brk;  /* first byte never handed out by mem_sbrk */
+static char *mem_commit_brk; /* first byte that isn't committed (MEM_RESERVE only) */
+static pthread_mutex_t mem_commit_lock = PTHREAD_MUTEX_INITIALIZER; /* guards mem_commit_brk */
+static int mem_backend = MEM_MMAP; /* how the heap is backed, see mem_set_backend */
+static int mem_huge = 0;     /* back the heap with transparent huge pages? */
+static int mem_pages = MEM_PAGES_ASIS; /* what happens to pages across runs */
+static double mem_cost_fixed;/* cost model: secs charged per mem_sbrk call ... */
+static double mem_cost_page; /* ... plus secs per page it grows or shrinks by */
+static int mem_cost_spin;    /* spin for the cost instead of just adding it up */
+static int mem_timing;       /* time every mem_sbrk call for the sbrk_secs stat? */
+static size_t mem_granule;   /* commit granule in bytes (MEM_RESERVE only) */
+static size_t mem_max_heap = MAX_HEAP; /* bytes the heap can grow to */
+static size_t mem_contig;    /* bytes mem_sbrk can grow the heap in place, 0 for all of it */
+static mem_stats_t mem_stats;/* what mem_sbrk has cost since the last mem_reset_stats */
+static size_t mem_mapped;    /* bytes in large object mappings */
+static size_t mem_peak;      /* high water mark of the footprint since the last reset */
+static size_t mem_peak_heap; /* ... and of the heap alone */
+static size_t mem_ahead;     /* bytes the helper keeps prefaulted above the brk, 0 for none */
+static char *mem_ahead_brk;  /* the helper has prefaulted everything from the brk up to here */
+static pthread_t mem_helper; /* the prefault helper thread ... */
+static int mem_helper_on;    /* ... whether it's running ... */
+static int mem_helper_stop;  /* ... and whether it should stop */
+
+/* 
+ * Large objects get mappings of their own, outside the heap. We keep 
+ * a list of them so they count toward the footprint, so the driver can
+ * tell they're legal payload addresses, and so mem_reset_brk can get 
+ * rid of them.
+ */
+typedef struct mapping_t {
+    char *lo;                /* first byte of the mapping */
+    size_t len;              /* length of the mapping in bytes */
+    struct mapping_t *next;  /* next mapping */
+} mapping_t;
+static mapping_t *mappings;  /* all live large object mappings */
+
+/* 
+ * Heap segments handed out by mem_segment once the heap can't grow in 
+ * place any more, kept the same way. They count toward the heap limit.
+ * Different threads can make and drop segments at once, so the list
+ * has a lock of its own.
+ */
+static mapping_t *segments;  /* all live heap segments */
+static size_t mem_segbytes;  /* bytes in heap segments */
+static pthread_mutex_t mem_seg_lock = PTHREAD_MUTEX_INITIALIZER; /* guards segments */
+
+/*
+ * The allocator's own bookkeeping from mem_map_meta, kept the same way.
+ * It's outside the heap and doesn't count toward the footprint.
+ */
+static mapping_t *metas;     /* all live bookkeeping mappings */
+
+static mapping_t **find_mapping(mapping_t **list, void *addr);
+static mapping_t *add_mapping(mapping_t **list, char *lo, size_t len);
+static void drop_mappings(mapping_t **list);
+static void update_peak(void);
+static int commit(char *hi);
+static void raise_brk(char **brk, char *hi);
+static void lower_brk(char **brk, char *lo);
+static void add_secs(double *secs, double incr);
+static void decommit(char *lo);
+static double mem_now(void);
+static void charge(intptr_t incr);
+static void *ahead_helper(void *arg);
+static void stop_helper(void);
+static void populate(char *lo, size_t len);
+
+/*
+ * mem_set_backend - choose how mem_init backs the heap. Has to be called
+ *    before mem_init. MEM_MMAP maps the whole heap read/write up front.
+ *    MEM_RESERVE only reserves the address range (PROT_NONE), and mem_sbrk
+ *    commits it with mprotect as the brk advances, granule bytes at a time
+ *    (rounded up to whole pages, 0 means one page). MEM_SYS reserves the
+ *    range too, but mem_sbrk grows the heap by mapping fresh pages over
+ *    the reservation and shrinks it by mapping the reservation back over
+ *    them, so growing and shrinking the heap costs what it would with a 
+ *    real brk (new pages are zero, and pages given back are gone).
+ */
+void mem_set_backend(int backend, size_t granule)
+{
+    size_t pagesize = mem_pagesize();
+
+    mem_backend = backend;
+    mem_granule = (granule + pagesize - 1) & ~(pagesize - 1);
+    if (mem_granule == 0)
+	mem_granule = pagesize;
+}
+
+/*
+ * mem_set_max_heap - set how big the heap can get, in bytes, instead of
+ *    the MAX_HEAP default. Has to be called before mem_init. It's rounded
+ *    up to whole huge pages, so the huge page option can use all of it.
+ */
+void mem_set_max_heap(size_t bytes)
+{
+    mem_max_heap = (bytes + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+}
+
+/*
+ * mem_set_contig - let mem_sbrk grow the heap only bytes past its start,
+ *    as if it ran into some other mapping there. Past that the allocator
+ *    has to ask mem_segment for more. 0 (the default) lets it grow all 
+ *    the way to the heap limit.
+ */
+void mem_set_contig(size_t bytes)
+{
+    mem_contig = bytes;
+}
+
+/*
+ * mem_set_ahead - keep bytes of the heap above the brk prefaulted with a 
+ *    helper thread, so extending the heap doesn't put first touch page
+ *    faults inline with the allocator. 0 stops the helper, so it doesn't
+ *    compete with runs that aren't measuring it. Can be called before or
+ *    after mem_init, the helper starts the first time it has something to
+ *    do. It can't work ahead of MEM_SYS, which only maps pages as the brk
+ *    reaches them, or past what MEM_RESERVE has committed.
+ */
+void mem_set_ahead(size_t bytes)
+{
+    __atomic_store_n(&mem_ahead, bytes, __ATOMIC_RELAXED);
+    if (bytes == 0)
+	stop_helper();
+    if (bytes > 0 && mem_start_brk != NULL && !mem_helper_on && mem_backend != MEM_SYS) {
+	if (pthread_create(&mem_helper, NULL, ahead_helper, NULL) != 0) {
+	    fprintf(stderr, "mem_set_ahead: couldn't start the prefault helper\n");
+	    return;
+	}
+	mem_helper_on = 1;
+    }
+}
+
+/*
+ * stop_helper - stop the prefault helper thread, if it's running, and
+ *    wait for it to finish
+ */
+static void stop_helper(void)
+{
+    if (!mem_helper_on)
+	return;
+    __atomic_store_n(&mem_helper_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(mem_helper, NULL);
+    mem_helper_on = mem_helper_stop = 0;
+}
+
+/*
+ * mem_set_hugepages - if on, the next mem_init puts the heap on a 
+ *    HUGEPAGE_SIZE boundary and asks for transparent huge pages with
+ *    madvise(MADV_HUGEPAGE). Whether the kernel actually hands them out
+ *    is up to it, mem_hugepage_bytes tells.
+ */
+void mem_set_hugepages(int on)
+{
+    mem_huge = on;
+}
+
+/*
+ * mem_set_pages - choose what the heap's pages look like when a run 
+ *    starts. MEM_PAGES_ASIS leaves whatever the last run touched mapped.
+ *    MEM_PAGES_WARM also maps large objects with MAP_POPULATE, and goes 
+ *    with mem_prefault for the heap. MEM_PAGES_COLD makes mem_reset_brk
+ *    give all of the heap's pages back, so every run faults them in again.
+ */
+void mem_set_pages(int mode)
+{
+    mem_pages = mode;
+}
+
+/*
+ * mem_set_cost - make every mem_sbrk call cost fixed_usecs, plus 
+ *    page_usecs for every page the heap grows or shrinks by, to model
+ *    environments where growing the heap is slow (VMs, memory cgroups).
+ *    With spin set, mem_sbrk busy waits for that long, so the cost shows
+ *    up in the timings. Otherwise it's only added up in the cost_secs 
+ *    stat, for the caller to add to its own timings. All zero turns the
+ *    cost model off.
+ */
+void mem_set_cost(double fixed_usecs, double page_usecs, int spin)
+{
+    mem_cost_fixed = fixed_usecs * 1e-6;
+    mem_cost_page = page_usecs * 1e-6;
+    mem_cost_spin = spin;
+}
+
+/*
+ * mem_set_timing - time every mem_sbrk call and add it up in the 
+ *    sbrk_secs stat (on), or don't (off, the default). It takes two 
+ *    clock reads per call, so leave it off for runs that are being timed.
+ */
+void mem_set_timing(int on)
+{
+    mem_timing = on;
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    size_t len = mem_max_heap;
+    char *base, *lo;
+
+    /* 
+     * allocate the storage we will use to model the available VM. 
+     * It's an anonymous mapping of its own, so it starts out zero just
+     * like fresh pages from sbrk, and pages can be given back with madvise.
+     * For huge pages, map an extra HUGEPAGE_SIZE and cut it down to an
+     * aligned heap.
+     */
+    if (mem_huge)
+	len += HUGEPAGE_SIZE;
+    if (mem_backend != MEM_MMAP)
+	base = (char *)mmap(NULL, len, PROT_NONE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    else
+	base = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
+    mem_start_brk = base;
+    if (mem_huge) {
+	lo = (char *)(((size_t)base + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1));
+	if (lo > base)
+	    munmap(base, lo - base);
+	if (lo + mem_max_heap < base + len)
+	    munmap(lo + mem_max_heap, (base + len) - (lo + mem_max_heap));
+	mem_start_brk = lo;
+#ifdef MADV_HUGEPAGE
+	if (mem_backend != MEM_SYS && 
+	    madvise(mem_start_brk, mem_max_heap, MADV_HUGEPAGE) < 0)
+	    fprintf(stderr, "mem_init_vm: no transparent huge pages (%s)\n", 
+		    strerror(errno));
+#endif
+    }
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
+    mem_max_addr = mem_start_brk + mem_max_heap; /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_fresh_brk = mem_start_brk;            /* and none of it is touched */
+    mem_commit_brk = mem_backend == MEM_MMAP ? mem_max_addr : mem_start_brk;
+    mem_reset_stats();
+    mem_mapped = 0;
+    mem_segbytes = 0;
+    mem_peak = 0;
+    mem_peak_heap = 0;
+    mappings = NULL;
+    segments = NULL;
+    metas = NULL;
+    mem_ahead_brk = mem_start_brk;
+    mem_set_ahead(mem_ahead);
 }
 
 /* 
@@ -39,35 +282,614 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    stop_helper();
+    mem_reset_brk();
+    munmap(mem_start_brk, mem_max_heap);
+    mem_start_brk = NULL;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and unmap any large objects and heap segments that are still around
  */
 void mem_reset_brk()
 {
+    drop_mappings(&mappings);
+    drop_mappings(&segments);
+    drop_mappings(&metas);
+    mem_mapped = 0;
+    mem_segbytes = 0;
     mem_brk = mem_start_brk;
+    mem_peak = 0;
+    mem_peak_heap = 0;
+
+    /* A real heap starts every run with nothing committed */
+    if (mem_backend == MEM_SYS)
+	decommit(mem_start_brk);
+
+    /* The dropped pages read as zero again, so they count as fresh */
+    if (mem_pages == MEM_PAGES_COLD && mem_fresh_brk > mem_start_brk) {
+	madvise(mem_start_brk, mem_fresh_brk - mem_start_brk, MADV_DONTNEED);
+	mem_fresh_brk = mem_start_brk;
+	__atomic_store_n(&mem_ahead_brk, mem_start_brk, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * mem_prefault - fault in the first len bytes of the heap (committing
+ *    them first with the reserve backend), so that a timed run doesn't 
+ *    take page faults on them. Uses MADV_POPULATE_WRITE where the kernel
+ *    has it, and writes to every page otherwise. The bytes keep their 
+ *    values either way. Returns the number of bytes prefaulted.
+ */
+size_t mem_prefault(size_t len)
+{
+    size_t pagesize = mem_pagesize();
+    volatile char *p;
+
+    len = (len + pagesize - 1) & ~(pagesize - 1);
+    if (len > mem_max_heap)
+	len = mem_max_heap;
+    if (mem_start_brk + len > mem_commit_brk && commit(mem_start_brk + len) < 0)
+	return 0;
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(mem_start_brk, len, MADV_POPULATE_WRITE) == 0)
+	return len;
+#endif
+    for (p = mem_start_brk; p < mem_start_brk + len; p += pagesize)
+	*p = *p;
+    return len;
+}
+
+/*
+ * ahead_helper - the prefault helper thread. Every time the brk gets 
+ *    within mem_ahead bytes of what it has already prefaulted, it 
+ *    prefaults up to mem_ahead bytes past the brk again. Otherwise it 
+ *    naps. It's best effort: if a cold mem_reset_brk rewinds the 
+ *    watermark while it's working, the compare and swap fails and it 
+ *    starts over from the new one.
+ */
+static void *ahead_helper(void *arg)
+{
+    struct timespec nap = {0, 20000}; /* 20 usecs */
+    size_t pagesize = mem_pagesize();
+    size_t ahead;
+    char *brk, *old, *lo, *hi, *commit_brk;
+
+    while (!__atomic_load_n(&mem_helper_stop, __ATOMIC_ACQUIRE)) {
+	ahead = __atomic_load_n(&mem_ahead, __ATOMIC_RELAXED);
+	brk = __atomic_load_n(&mem_brk, __ATOMIC_RELAXED);
+	lo = old = __atomic_load_n(&mem_ahead_brk, __ATOMIC_ACQUIRE);
+	if (lo < brk)  /* fell behind, the allocator faulted those in itself */
+	    lo = (char *)((size_t)brk & ~(pagesize - 1));
+	hi = (char *)(((size_t)brk + ahead + pagesize - 1) & ~(pagesize - 1));
+	commit_brk = __atomic_load_n(&mem_commit_brk, __ATOMIC_ACQUIRE);
+	if (hi > commit_brk)
+	    hi = commit_brk;
+	if (ahead == 0 || hi <= lo) {
+	    nanosleep(&nap, NULL);
+	    continue;
+	}
+	populate(lo, hi - lo);
+	__atomic_compare_exchange_n(&mem_ahead_brk, &old, hi, 0,
+				    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*
+ * populate - fault in the pages of [lo, lo+len) without changing a byte,
+ *    since the allocator may already be writing to the start of it. 
+ *    MADV_POPULATE_WRITE does that, and so does an atomic add of zero to
+ *    every page where the kernel doesn't have it.
+ */
+static void populate(char *lo, size_t len)
+{
+    size_t pagesize = mem_pagesize();
+    char *p;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(lo, len, MADV_POPULATE_WRITE) == 0)
+	return;
+#endif
+    for (p = lo; p < lo + len; p += pagesize)
+	__atomic_fetch_add(p, 0, __ATOMIC_RELAXED);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap, like sbrk does, and returns the
+ *    old brk. The heap can't be shrunk below its start. incr is an 
+ *    intptr_t like sbrk's, so heaps past 2 GB work on 64-bit builds.
+ *
+ *    Any number of threads can grow the heap at once without a lock.
+ *    Each one checks the limits against the brk it read, commits what
+ *    it needs (MEM_RESERVE and MEM_SYS, the only part that takes a lock),
+ *    and only then moves the brk with a compare and swap, starting over
+ *    if another thread moved it first. So the brk never goes past a 
+ *    limit, not even for a moment, and a failed call leaves nothing to 
+ *    undo. Shrinking only makes sense for whoever owns the top of the 
+ *    heap, and it can't race growing: MEM_SYS unmaps the pages above 
+ *    the new brk, which a grower could be handing out. The caller has to
+ *    keep shrinks apart from every other mem_sbrk call (mm.c does both 
+ *    under its heap lock).
  */
-void *mem_sbrk(int incr) 
+void *mem_sbrk(intptr_t incr) 
 {
-    char *old_brk = mem_brk;
+    char *old_brk, *new_brk;
+    size_t used;
+    int err;
+    double start = mem_timing ? mem_now() : 0;
+
+    __atomic_fetch_add(&mem_stats.sbrk_calls, 1, __ATOMIC_RELAXED);
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
-	errno = ENOMEM;
-	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
-	return (void *)-1;
+    if (incr < 0) {
+	old_brk = __atomic_load_n(&mem_brk, __ATOMIC_RELAXED);
+	do {
+	    if (-incr > old_brk - mem_start_brk) {
+		errno = EINVAL;
+		fprintf(stderr, "ERROR: mem_sbrk failed. Can't shrink below the heap start...\n");
+		return (void *)-1;
+	    }
+	} while (!__atomic_compare_exchange_n(&mem_brk, &old_brk, old_brk + incr, 1,
+					      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	if (mem_backend == MEM_SYS) {
+	    pthread_mutex_lock(&mem_commit_lock);
+	    decommit(old_brk + incr);
+	    pthread_mutex_unlock(&mem_commit_lock);
+	}
     }
-    mem_brk += incr;
+    else {
+	old_brk = __atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE);
+	do {
+	    new_brk = old_brk + incr;
+	    used = (size_t)(old_brk - mem_start_brk) + 
+		__atomic_load_n(&mem_segbytes, __ATOMIC_RELAXED);
+	    if (incr > mem_max_addr - old_brk) {
+		errno = ENOMEM;
+		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+		return (void *)-1;
+	    }
+	    /* Running into the end of the contiguous part is expected, so no noise */
+	    if ((mem_contig && incr > mem_start_brk + mem_contig - old_brk) ||
+		used + incr > mem_max_heap) {
+		errno = ENOMEM;
+		return (void *)-1;
+	    }
+	    /* Committed pages above the brk are fine if the swap fails */
+	    if (new_brk > __atomic_load_n(&mem_commit_brk, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&mem_commit_lock);
+		err = new_brk > mem_commit_brk && commit(new_brk) < 0;
+		pthread_mutex_unlock(&mem_commit_lock);
+		if (err) {
+		    errno = ENOMEM;
+		    fprintf(stderr, "ERROR: mem_sbrk failed. Couldn't commit the heap...\n");
+		    return (void *)-1;
+		}
+	    }
+	} while (!__atomic_compare_exchange_n(&mem_brk, &old_brk, new_brk, 1,
+					      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	raise_brk(&mem_fresh_brk, new_brk);
+    }
+    update_peak();
+    charge(incr);
+    if (mem_timing)
+	add_secs(&mem_stats.sbrk_secs, mem_now() - start);
     return (void *)old_brk;
 }
 
+/*
+ * raise_brk - move the watermark *brk up to hi, unless it's already past
+ */
+static void raise_brk(char **brk, char *hi)
+{
+    char *old = __atomic_load_n(brk, __ATOMIC_RELAXED);
+
+    while (old < hi &&
+	   !__atomic_compare_exchange_n(brk, &old, hi, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	;
+}
+
+/*
+ * lower_brk - move the watermark *brk down to lo, unless it's already below
+ */
+static void lower_brk(char **brk, char *lo)
+{
+    char *old = __atomic_load_n(brk, __ATOMIC_RELAXED);
+
+    while (old > lo &&
+	   !__atomic_compare_exchange_n(brk, &old, lo, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	;
+}
+
+/*
+ * add_secs - add incr to the time total *secs, which threads may be 
+ *    adding to at the same time (there's no atomic add for doubles)
+ */
+static void add_secs(double *secs, double incr)
+{
+    double old, new;
+
+    __atomic_load(secs, &old, __ATOMIC_RELAXED);
+    do
+	new = old + incr;
+    while (!__atomic_compare_exchange(secs, &old, &new, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * commit - make the heap readable and writable up to at least hi, a 
+ *    whole granule at a time. MEM_RESERVE does it with mprotect, and its
+ *    pages stay committed when the heap shrinks, the next mem_sbrk that
+ *    grows it again is likely to need them. MEM_SYS maps new pages over
+ *    the reservation (MAP_FIXED is safe there, nothing else can be mapped
+ *    inside it). Returns 0 on success and -1 on error. mem_sbrk calls it
+ *    with mem_commit_lock held.
+ */
+static int commit(char *hi)
+{
+    size_t len = (size_t)(hi - mem_commit_brk);
+    char *p;
+
+    len = (len + mem_granule - 1) / mem_granule * mem_granule;
+    if (len > (size_t)(mem_max_addr - mem_commit_brk))
+	len = (size_t)(mem_max_addr - mem_commit_brk);
+    mem_stats.syscalls++;
+    if (mem_backend == MEM_SYS) {
+	p = (char *)mmap(mem_commit_brk, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	if (p == MAP_FAILED)
+	    return -1;
+#ifdef MADV_HUGEPAGE
+	if (mem_huge)
+	    madvise(p, len, MADV_HUGEPAGE);
+#endif
+    }
+    else if (mprotect(mem_commit_brk, len, PROT_READ | PROT_WRITE) < 0)
+	return -1;
+    __atomic_store_n(&mem_commit_brk, mem_commit_brk + len, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * decommit - MEM_SYS only. Give the heap's whole pages from lo up back,
+ *    the way a shrinking brk does, by mapping a fresh PROT_NONE piece of
+ *    the reservation over them (munmap would leave a hole that anything
+ *    else could get mapped into). They'll be zero when they get committed
+ *    again, so the fresh watermark comes down with them. Called with 
+ *    mem_commit_lock held, like commit.
+ */
+static void decommit(char *lo)
+{
+    size_t pagesize = mem_pagesize();
+    char *top = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+
+    if (top >= mem_commit_brk)
+	return;
+    mem_stats.syscalls++;
+    mmap(top, mem_commit_brk - top, PROT_NONE,
+	 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    __atomic_store_n(&mem_commit_brk, top, __ATOMIC_RELEASE);
+    lower_brk(&mem_fresh_brk, top);
+}
+
+/*
+ * charge - charge a mem_sbrk call of incr bytes to the cost model
+ */
+static void charge(intptr_t incr)
+{
+    size_t pagesize = mem_pagesize();
+    size_t pages = ((size_t)(incr < 0 ? -incr : incr) + pagesize - 1) / pagesize;
+    double cost = mem_cost_fixed + pages * mem_cost_page;
+    double end;
+
+    if (cost <= 0)
+	return;
+    add_secs(&mem_stats.cost_secs, cost);
+    if (mem_cost_spin) {
+	end = mem_now() + cost;
+	while (mem_now() < end)
+	    ;
+    }
+}
+
+/*
+ * mem_get_stats - copy what mem_sbrk has cost since the last reset into *stats
+ */
+void mem_get_stats(mem_stats_t *stats)
+{
+    *stats = mem_stats;
+    stats->committed = (size_t)(mem_commit_brk - mem_start_brk) + mem_segbytes;
+}
+
+/*
+ * mem_reset_stats - start counting mem_sbrk's cost from zero
+ */
+void mem_reset_stats(void)
+{
+    memset(&mem_stats, 0, sizeof(mem_stats));
+}
+
+/*
+ * mem_now - a timestamp in seconds, for timing single mem_sbrk calls
+ *    (gettimeofday is too coarse for that)
+ */
+static double mem_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * mem_map - give a large object a len byte anonymous mapping of its own, 
+ *    outside the heap. len should be a multiple of the page size.
+ *    Returns NULL if the mapping couldn't be made.
+ */
+void *mem_map(size_t len)
+{
+    char *lo;
+
+    lo = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | 
+		      MAP_ANONYMOUS | (mem_pages == MEM_PAGES_WARM ? MAP_POPULATE : 0), 
+		      -1, 0);
+    if (lo == MAP_FAILED)
+	return NULL;
+    if (add_mapping(&mappings, lo, len) == NULL) {
+	munmap(lo, len);
+	return NULL;
+    }
+    __atomic_fetch_add(&mem_mapped, len, __ATOMIC_RELAXED);
+    update_peak();
+    return (void *)lo;
+}
+
+/*
+ * mem_map_meta - give the allocator len bytes (rounded up to whole pages)
+ *    of zeroed memory for its own bookkeeping, like a table with an entry
+ *    per CPU. It's outside the heap and doesn't count toward the footprint,
+ *    so it doesn't make the same trace's utilization depend on the machine.
+ *    It goes away with everything else at the next mem_reset_brk. Returns
+ *    NULL if it couldn't be mapped.
+ */
+void *mem_map_meta(size_t len)
+{
+    size_t pagesize = mem_pagesize();
+    char *lo;
+
+    len = (len + pagesize - 1) & ~(pagesize - 1);
+    lo = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE, 
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (lo == MAP_FAILED)
+	return NULL;
+    if (add_mapping(&metas, lo, len) == NULL) {
+	munmap(lo, len);
+	return NULL;
+    }
+    return (void *)lo;
+}
+
+/*
+ * mem_segment - start a new heap segment of len bytes (rounded up to 
+ *    whole pages), for when mem_sbrk can't grow the heap in place any 
+ *    more. It's a mapping of its own, so it's not adjacent to the heap 
+ *    or to any other segment, and it starts out zero. It starts on an
+ *    align boundary (a power of two, 0 for any page), so whoever owns
+ *    it can be found from any address in its first align bytes.
+ *    Segments count toward the heap limit. Returns NULL if there's no 
+ *    room for it. Like mem_sbrk, any number of threads can make (and
+ *    drop) segments at once: the room is claimed with a compare and swap
+ *    on the segment bytes before the mapping is made, and only adding it
+ *    to the list takes a lock. A segment and a heap growth that race can
+ *    each see the other's room as free, so together they can overshoot
+ *    the limit by one of them.
+ */
+void *mem_segment(size_t len, size_t align)
+{
+    size_t pagesize = mem_pagesize();
+    size_t extra, head, used;
+    char *lo;
+    mapping_t *m;
+
+    len = (len + pagesize - 1) & ~(pagesize - 1);
+    used = __atomic_load_n(&mem_segbytes, __ATOMIC_RELAXED);
+    do {
+	if (len > mem_max_heap - mem_heapsize() - used)
+	    return NULL;
+    } while (!__atomic_compare_exchange_n(&mem_segbytes, &used, used + len, 1,
+					  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    extra = (align > pagesize) ? align - pagesize : 0;
+    __atomic_fetch_add(&mem_stats.syscalls, 1, __ATOMIC_RELAXED);
+    lo = (char *)mmap(NULL, len + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | 
+		      MAP_ANONYMOUS | (mem_pages == MEM_PAGES_WARM ? MAP_POPULATE : 0), 
+		      -1, 0);
+    if (lo == MAP_FAILED) {
+	__atomic_fetch_sub(&mem_segbytes, len, __ATOMIC_RELAXED);
+	return NULL;
+    }
+    /* Trim the mapping down to len bytes on an align boundary */
+    if (extra) {
+	head = (align - ((size_t)lo & (align - 1))) & (align - 1);
+	if (head)
+	    munmap(lo, head);
+	if (extra - head)
+	    munmap(lo + head + len, extra - head);
+	lo += head;
+    }
+    pthread_mutex_lock(&mem_seg_lock);
+    m = add_mapping(&segments, lo, len);
+    pthread_mutex_unlock(&mem_seg_lock);
+    if (m == NULL) {
+	munmap(lo, len);
+	__atomic_fetch_sub(&mem_segbytes, len, __ATOMIC_RELAXED);
+	return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (mem_huge)
+	madvise(lo, len, MADV_HUGEPAGE);
+#endif
+    __atomic_fetch_add(&mem_stats.segments, 1, __ATOMIC_RELAXED);
+    update_peak();
+    return (void *)lo;
+}
+
+/*
+ * mem_unsegment - give the heap segment made by mem_segment at addr back
+ */
+void mem_unsegment(void *addr)
+{
+    mapping_t **mp;
+    mapping_t *m;
+
+    pthread_mutex_lock(&mem_seg_lock);
+    if ((mp = find_mapping(&segments, addr)) == NULL) {
+	pthread_mutex_unlock(&mem_seg_lock);
+	return;
+    }
+    m = *mp;
+    *mp = m->next;
+    pthread_mutex_unlock(&mem_seg_lock);
+    __atomic_fetch_add(&mem_stats.syscalls, 1, __ATOMIC_RELAXED);
+    munmap(m->lo, m->len);
+    __atomic_fetch_sub(&mem_segbytes, m->len, __ATOMIC_RELAXED);
+    free(m);
+}
+
+/*
+ * mem_remap - grow or shrink the mapping made by mem_map at addr to 
+ *    newlen bytes with mremap. The kernel moves the page tables instead 
+ *    of copying the bytes. Returns the (maybe moved) mapping, or NULL if
+ *    it couldn't be resized, in which case the old one is untouched.
+ */
+void *mem_remap(void *addr, size_t newlen)
+{
+    mapping_t **mp = find_mapping(&mappings, addr);
+    mapping_t *m;
+    char *lo;
+
+    if (mp == NULL)
+	return NULL;
+    m = *mp;
+    lo = (char *)mremap(m->lo, m->len, newlen, MREMAP_MAYMOVE);
+    if (lo == MAP_FAILED)
+	return NULL;
+    __atomic_fetch_add(&mem_mapped, newlen - m->len, __ATOMIC_RELAXED);
+    m->lo = lo;
+    m->len = newlen;
+    update_peak();
+    return (void *)lo;
+}
+
+/*
+ * mem_unmap - release the mapping made by mem_map at addr right away
+ */
+void mem_unmap(void *addr)
+{
+    mapping_t **mp = find_mapping(&mappings, addr);
+    mapping_t *m;
+
+    if (mp == NULL)
+	return;
+    m = *mp;
+    *mp = m->next;
+    munmap(m->lo, m->len);
+    __atomic_fetch_sub(&mem_mapped, m->len, __ATOMIC_RELAXED);
+    free(m);
+}
+
+/*
+ * mem_contains - return true if [lo, hi] lies entirely inside the heap,
+ *    inside a single heap segment, or inside a single large object mapping
+ */
+int mem_contains(void *lo, void *hi)
+{
+    mapping_t *m;
+
+    if ((char *)lo >= mem_start_brk && (char *)hi < mem_brk)
+	return 1;
+    pthread_mutex_lock(&mem_seg_lock);
+    for (m = segments; m != NULL; m = m->next)
+	if ((char *)lo >= m->lo && (char *)hi < m->lo + m->len)
+	    break;
+    pthread_mutex_unlock(&mem_seg_lock);
+    if (m != NULL)
+	return 1;
+    for (m = mappings; m != NULL; m = m->next)
+	if ((char *)lo >= m->lo && (char *)hi < m->lo + m->len)
+	    return 1;
+    return 0;
+}
+
+/*
+ * find_mapping - return the link in list that points at the mapping 
+ *    starting at addr, or NULL if there isn't one
+ */
+static mapping_t **find_mapping(mapping_t **list, void *addr)
+{
+    mapping_t **mp;
+
+    for (mp = list; *mp != NULL; mp = &(*mp)->next)
+	if ((*mp)->lo == (char *)addr)
+	    return mp;
+    return NULL;
+}
+
+/*
+ * add_mapping - put the len byte mapping at lo on list. Returns the new
+ *    entry, or NULL if there's no memory for it.
+ */
+static mapping_t *add_mapping(mapping_t **list, char *lo, size_t len)
+{
+    mapping_t *m;
+
+    if ((m = (mapping_t *)malloc(sizeof(mapping_t))) == NULL)
+	return NULL;
+    m->lo = lo;
+    m->len = len;
+    m->next = *list;
+    *list = m;
+    return m;
+}
+
+/*
+ * drop_mappings - unmap every mapping on list and empty it
+ */
+static void drop_mappings(mapping_t **list)
+{
+    mapping_t *m;
+
+    while ((m = *list) != NULL) {
+	*list = m->next;
+	munmap(m->lo, m->len);
+	free(m);
+    }
+}
+
+/*
+ * update_peak - fold the current footprint and heap size into their
+ *    high water marks
+ */
+static void update_peak(void)
+{
+    size_t footprint = mem_footprint();
+    size_t heapsize = mem_heapsize();
+    size_t old = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+
+    while (footprint > old &&
+	   !__atomic_compare_exchange_n(&mem_peak, &old, footprint, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+    old = __atomic_load_n(&mem_peak_heap, __ATOMIC_RELAXED);
+    while (heapsize > old &&
+	   !__atomic_compare_exchange_n(&mem_peak_heap, &old, heapsize, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -81,7 +903,17 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return (void *)(__atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE) - 1);
+}
+
+/*
+ * mem_fresh_lo - return the lowest heap address that mem_sbrk has never
+ *    handed out. Everything from there up is still zero. mem_reset_brk
+ *    doesn't move it, since the rewound heap is still dirty.
+ */
+void *mem_fresh_lo()
+{
+    return (void *)__atomic_load_n(&mem_fresh_brk, __ATOMIC_ACQUIRE);
 }
 
 /*
@@ -89,7 +921,148 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return (size_t)(__atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE) - mem_start_brk);
+}
+
+/*
+ * mem_footprint() - returns the heap size plus the size of all the heap
+ *    segments and large object mappings, in bytes
+ */
+size_t mem_footprint() 
+{
+    return mem_heapsize() + __atomic_load_n(&mem_segbytes, __ATOMIC_RELAXED) +
+	__atomic_load_n(&mem_mapped, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_peak_footprint() - returns the largest the footprint has been, in
+ *    bytes, since the last mem_reset_brk. Once the heap can shrink, this
+ *    is the high water mark that utilization has to be measured against.
+ */
+size_t mem_peak_footprint() 
+{
+    return mem_peak;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest the heap itself has been, in
+ *    bytes, since the last mem_reset_brk. Unlike the peak footprint, it
+ *    leaves out segments and large object mappings, so it's how much of
+ *    the heap mem_prefault has to touch to cover a run.
+ */
+size_t mem_peak_heapsize() 
+{
+    return mem_peak_heap;
+}
+
+/*
+ * mem_purge - give the physical pages backing the page-aligned interior
+ *    of [addr, addr+len) back to the system with madvise. The range stays
+ *    mapped, and reads as zero the next time it's touched (which costs a
+ *    page fault). Returns the number of bytes purged.
+ */
+size_t mem_purge(void *addr, size_t len)
+{
+    size_t pagesize = mem_pagesize();
+    char *lo = (char *)(((size_t)addr + pagesize - 1) & ~(pagesize - 1));
+    char *hi = (char *)(((size_t)addr + len) & ~(pagesize - 1));
+
+    if (hi <= lo)
+	return 0;
+    if (madvise(lo, hi - lo, MADV_DONTNEED) < 0)
+	return 0;
+    return (size_t)(hi - lo);
+}
+
+/*
+ * mem_move_pages - move the pages backing [src, src+len) of the heap to
+ *    [dst, dst+len) with mremap, instead of copying the bytes. Both
+ *    addresses and len have to be page aligned, both ranges have to be
+ *    below the brk, and they can't overlap. mremap leaves a hole where
+ *    src was, so fresh pages of the heap's own mapping (which read as 
+ *    zero, and ask for huge pages if the rest of the heap does) get 
+ *    mapped back over it, and nothing else can land there. Returns 0 on
+ *    success, or -1 if nothing was moved and the caller has to copy.
+ */
+int mem_move_pages(void *dst, void *src, size_t len)
+{
+    size_t pagesize = mem_pagesize();
+    char *d = (char *)dst, *s = (char *)src;
+    char *brk = __atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE);
+
+    if (((size_t)d | (size_t)s | len) & (pagesize - 1))
+	return -1;
+    if (len == 0 || (d < s + len && s < d + len))
+	return -1;
+    if (s < mem_start_brk || s + len > brk ||
+	d < mem_start_brk || d + len > brk)
+	return -1;
+
+    if (mremap(s, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, d) == MAP_FAILED)
+	return -1;
+    if (mmap(s, len, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_move_pages couldn't refill the heap at %p\n", s);
+	exit(1);
+    }
+#ifdef MADV_HUGEPAGE
+    if (mem_huge) {
+	madvise(s, len, MADV_HUGEPAGE);
+	madvise(d, len, MADV_HUGEPAGE);
+    }
+#endif
+    __atomic_add_fetch(&mem_stats.syscalls, 2, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * mem_hugepage_bytes() - returns how many bytes of the heap the kernel
+ *    has actually backed with transparent huge pages, by adding up the
+ *    AnonHugePages lines of the heap's entries in /proc/self/smaps.
+ *    Returns 0 if smaps can't be read.
+ */
+size_t mem_hugepage_bytes()
+{
+    FILE *fp;
+    char line[256];
+    unsigned long lo, hi, kb;
+    int in_heap = 0;
+    size_t bytes = 0;
+
+    if ((fp = fopen("/proc/self/smaps", "r")) == NULL)
+	return 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+	    in_heap = (char *)lo >= mem_start_brk && (char *)hi <= mem_max_addr;
+	else if (in_heap && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+	    bytes += (size_t)kb * 1024;
+    }
+    fclose(fp);
+    return bytes;
+}
+
+/*
+ * mem_resident() - returns the number of bytes of the heap that are
+ *    backed by physical pages right now (the heap's resident set).
+ */
+size_t mem_resident()
+{
+    size_t pagesize = mem_pagesize();
+    size_t npages = (mem_heapsize() + pagesize - 1) / pagesize;
+    size_t i, resident = 0;
+    unsigned char *vec;
+
+    if (npages == 0)
+	return 0;
+    if ((vec = (unsigned char *)malloc(npages)) == NULL)
+	return 0;
+    if (mincore(mem_start_brk, npages * pagesize, vec) == 0) {
+	for (i = 0; i < npages; i++)
+	    if (vec[i] & 1)
+		resident++;
+    }
+    free(vec);
+    return resident * pagesize;
 }
 
 /*
@@ -1,11 +1,57 @@
 #include <unistd.h>
 
+/* Heap backends for mem_set_backend */
+#define MEM_MMAP    0   /* map the whole heap read/write up front */
+#define MEM_RESERVE 1   /* reserve the heap, commit it as mem_sbrk grows */
+#define MEM_SYS     2   /* grow and shrink it with real mmap/munmap calls */
+
+/* Page modes for mem_set_pages */
+#define MEM_PAGES_ASIS 0 /* keep whatever pages the last run touched */
+#define MEM_PAGES_WARM 1 /* prefault: populate mappings up front */
+#define MEM_PAGES_COLD 2 /* mem_reset_brk gives every page back */
+
+/* What mem_sbrk has cost since the last mem_reset_stats */
+typedef struct {
+    long sbrk_calls;     /* number of mem_sbrk calls */
+    long syscalls;       /* system calls they made (mprotect, mmap, munmap) */
+    double sbrk_secs;    /* time spent in mem_sbrk (see mem_set_timing) */
+    double cost_secs;    /* cost the cost model charged (see mem_set_cost) */
+    long segments;       /* heap segments mem_segment mapped */
+    size_t committed;    /* bytes of the heap committed right now (segments too) */
+} mem_stats_t;
+
+void mem_set_backend(int backend, size_t granule);
+void mem_set_max_heap(size_t bytes);
+void mem_set_contig(size_t bytes);
+void mem_set_hugepages(int on);
+void mem_set_pages(int mode);
+void mem_set_ahead(size_t bytes);
+void mem_set_cost(double fixed_usecs, double page_usecs, int spin);
+void mem_set_timing(int on);
 void mem_init(void);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
+void *mem_map(size_t len);
+void *mem_remap(void *addr, size_t newlen);
+void mem_unmap(void *addr);
+void *mem_map_meta(size_t len);
+void *mem_segment(size_t len, size_t align);
+void mem_unsegment(void *addr);
+int mem_contains(void *lo, void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_fresh_lo(void);
 size_t mem_heapsize(void);
+size_t mem_footprint(void);
+size_t mem_peak_footprint(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
+size_t mem_purge(void *addr, size_t len);
+size_t mem_prefault(size_t len);
+int mem_move_pages(void *dst, void *src, size_t len);
+size_t mem_resident(void);
+size_t mem_hugepage_bytes(void);
+void mem_get_stats(mem_stats_t *stats);
+void mem_reset_stats(void);
 
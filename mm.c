@@ -6,11 +6,18 @@
  * 
  *      31                     3  2  1  0 
  *      -----------------------------------
- *     | s  s  s  s  ... s  s  s  0  0  a/f
+ *     | s  s  s  s  ... s  s  s  p  z  a/f
  *      ----------------------------------- 
  * 
  * where s are the meaningful size bits and a/f is set 
- * iff the block is allocated. The list has the following form:
+ * iff the block is allocated. z and p are only used by free blocks.
+ * z is set iff the payload is known to be zero apart from the free list pointers
+ * (fresh memory from mem_sbrk that nobody has written to yet).
+ * mm_calloc uses it to skip clearing those blocks.
+ * p is set iff mm_purge gave the pages in the middle of the block back to the system,
+ * so the next one to use the block pays for the page faults.
+ * In allocated blocks the z bit is the m bit instead, set iff the block is a large
+ * object with a mapping of its own outside the heap (see map_block). The list has the following form:
  *
  * begin                                                          end
  * heap                                                           heap  
@@ -23,10 +30,26 @@
  * The allocated prologue and epilogue blocks are overhead that
  * eliminate edge conditions during coalescing.
  *
- * Each free block has a pointer to the previous and next free blocks. 
- * The free_listp pointer points to the first free block in the explicit free list.
- * New free blocks are placed at the start of this list.
- * Free blocks are found by looping through the free list and using the first block that fits.
+ * Once mem_sbrk can't grow the heap in place any more, the heap goes on in segments
+ * from mem_segment, somewhere else in the address space. Each segment has the same
+ * layout as above, with its own prologue and epilogue, so coalescing never crosses
+ * from one segment into another. The heap and every segment start with two more words
+ * in front of the pad: the next segment of the same arena (which is how mm_checkheap
+ * finds them all), and the arena the segment belongs to.
+ *
+ * The free lists are split up into arenas (see mm_set_arenas), and each thread allocates
+ * from one of them. Arena 0 is the heap itself, plus its segments. The other arenas only
+ * have segments, each SEGMENT_SIZE bytes on a SEGMENT_SIZE boundary, so a block's arena
+ * is the one in the segment header at its address rounded down (or arena 0, if the block
+ * is in the heap). That's how mm_free gets a block back to the arena it came from.
+ * A block too big for a segment comes out of arena 0.
+ *
+ * Each free block has a pointer to the previous and next free blocks in the free list of
+ * its size class. Class c holds blocks from MINBLOCK<<c bytes up to MINBLOCK<<(c+1), and the
+ * last class holds everything bigger. Every arena's list heads live at the very start of the heap,
+ * in front of the prologue, along with the locks. New free blocks are placed at the start of their list.
+ * Free blocks are found by looping through the list for the request's size class and using the
+ * first block that fits, then moving on to the bigger classes.
  * 
  *      31                     3  2  1  0 
  *      -----------------------------------
@@ -37,6 +60,36 @@
  *      ----------------------------------- 
  *      ...................................
  *
+ * The allocator is thread-safe. Each size class of each arena has a lock that guards its free list
+ * and the boundary tags of the free blocks in it, and the heap lock guards growing and shrinking the
+ * heap (and arena 0's segments, and large object mappings). Every other arena has a segment lock
+ * that guards its own segments, so arenas that grow don't wait on each other or on the heap.
+ * Nothing but lock_world holds locks of two arenas.
+ * A block that one thread is working on (taken out of a free list, or on its way into one, or
+ * waiting in a remote free queue) stays marked allocated, so the other threads leave it alone.
+ * Coalescing peeks at the neighbors' tags, locks their classes and the merged block's class in
+ * ascending order (so two threads can't deadlock), and checks the tags again before merging.
+ * Two neighbors freed at the same time can end up not coalesced, which costs a little
+ * fragmentation but nothing else. mm_free_batch, mm_purge, and mm_checkheap take every lock.
+ * mm_set_locking(MM_LOCK_GLOBAL) makes every call take one big lock instead, to compare against.
+ *
+ * In front of all that, each thread has a cache of small blocks, one bin per block size up to
+ * CACHE_MAX. mm_free puts small blocks in the bin for their size (still marked allocated, so nobody
+ * else touches them), and mm_malloc takes them back out, without any locks at all. An empty bin is
+ * refilled with cache_low blocks carved out of one free block, and a bin that goes over cache_high
+ * is flushed back down to cache_low. The cache itself is a block in the heap, and it's drained
+ * back into the free lists when its thread exits.
+ *
+ * With mm_set_percpu, the small blocks go in per-CPU caches instead, in front of the thread caches.
+ * Their bins are arrays rather than lists, and a push or pop is a restartable sequence (rseq)
+ * that reads the CPU number and commits with one store, so it needs no locks either, and the
+ * blocks held in caches stay bounded by the number of CPUs rather than the number of threads.
+ * mm_purge drains the per-CPU caches, otherwise their blocks go away with the heap at the next mm_init.
+ *
+ * A block freed by a thread that isn't using its arena doesn't take that arena's locks. It's pushed
+ * on the arena's remote free queue with a single compare-and-swap instead, and the next malloc from
+ * the arena takes the whole queue at once and frees what's on it.
+ *
  *
  * Currently seems to score a 44 + 40 = 84 on csce.
  * On my desktop computer that this was developed it seems to score a 44 + 40 = 84.
@@ -51,10 +104,19 @@
  * // The mm-sample also shows correct score of 11, and I'm pretty sure the example provided was correct, so it's probably fine.
  */
 
+#define _GNU_SOURCE  // for sched_getcpu
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>  // __rseq_offset and __rseq_size, for the per-CPU caches
+#define HAVE_RSEQ
+#endif
+#endif
 #include "mm.h"
 #include "memlib.h"
 
@@ -68,10 +130,32 @@ team_t team = {
 
 // $begin mallocmacros
 // Basic constants and macros
-#define WSIZE       4       // word size (bytes)
-#define DSIZE       8       // doubleword size (bytes)
+#define WSIZE       sizeof(size_t) // word size (bytes), the size of a tag or a pointer
+#define DSIZE       (2*WSIZE)      // doubleword size (bytes), the payload alignment
 #define CHUNKSIZE  (1<<12)  // initial heap size (bytes)
-#define OVERHEAD    8       // overhead of header and footer (bytes)
+#define OVERHEAD    DSIZE   // overhead of header and footer (bytes)
+#define TRIM_THRESHOLD (CHUNKSIZE<<4) // free heap tail has to be bigger than this before it's given back (bytes)
+#define TOP_PAD    (CHUNKSIZE<<1)     // free heap tail left in place after trimming (bytes)
+#define TRIM_MAX   (1<<24)            // trim_threshold stops doubling here (bytes)
+#define PURGE_THRESHOLD (CHUNKSIZE<<3) // mm_purge leaves free blocks smaller than this alone (bytes)
+#define DIRTY_LOOKAHEAD 8             // free blocks find_fit looks past a clean fit for a dirty one
+#define MMAP_THRESHOLD (CHUNKSIZE<<5) // requests this big get a mapping of their own (bytes)
+#define REMAP_THRESHOLD (CHUNKSIZE<<2) // blocks realloc moves that are this big get placed on a page boundary
+#define PAGEMOVE_THRESHOLD (CHUNKSIZE<<4) // payloads this big move their pages instead of copying them (bytes)
+#define SEGMENT_SIZE (CHUNKSIZE<<6)  // size (and alignment) of every heap segment (bytes)
+#define SEGMENT_HEAD (3*DSIZE)       // from the start of the heap or a segment to its first block (bytes)
+#define NCLASSES    16                 // number of size classes (segregated free lists)
+#define MINBLOCK    (DSIZE + OVERHEAD) // smallest block (bytes)
+#define CACHE_MAX   (CHUNKSIZE>>3)     // biggest block the thread caches hold (bytes)
+#define CACHE_BINS  (CACHE_MAX/DSIZE + 1) // one bin per block size, indexed by size/DSIZE
+#define CACHE_BYTES (CACHE_BINS * (sizeof(char *) + sizeof(size_t))) // bin heads, then bin counts
+#define CACHE_HIGH  MM_CACHE_DEFAULT   // blocks a bin holds before it's flushed
+#define PCPU_MAX    (CHUNKSIZE>>4)     // biggest block the per-CPU caches hold (bytes)
+#define PCPU_BINS   (PCPU_MAX/DSIZE + 1) // one bin per block size, indexed by size/DSIZE
+#define PCPU_CAP    32                 // blocks a per-CPU bin holds
+#define PCPU_BIN_BYTES ((PCPU_CAP + 1) * sizeof(char *)) // block count, then the blocks
+#define PCPU_STRIDE (PCPU_BINS * PCPU_BIN_BYTES)         // one CPU's bins
+#define REMOTE_MAX  256                // blocks a remote free queue holds before the thread that fills it drains it
 
 // Return the maximum of two numbers
 #define MAX(x, y) ((x) > (y)? (x) : (y))  
@@ -79,13 +163,27 @@ team_t team = {
 // Pack a size and allocated bit into a word
 #define PACK(size, alloc)  ((size) | (alloc))
 
-// Read and write a word at address p 
+// Read and write a word at address p. Tags get peeked at without locks, so they're stored atomically.
 #define GET(p)       (*(size_t *)(p))
-#define PUT(p, val)  (*(size_t *)(p) = (val))  
+#define PUT(p, val)  __atomic_store_n((size_t *)(p), (val), __ATOMIC_RELAXED)
+
+// Read a word another thread may be writing, for a hint that gets checked again under a lock
+#define PEEK(p)      __atomic_load_n((size_t *)(p), __ATOMIC_RELAXED)
 
 // Read the size and allocated fields from address p 
-#define GET_SIZE(p)  (GET(p) & ~0x7)
+#define GET_SIZE(p)  (GET(p) & ~(DSIZE-1))
+#define TAG_SIZE(tag) ((tag) & ~(DSIZE-1))
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_ZERO(p)  (GET(p) & ZERO)
+#define GET_FLAGS(p) (GET(p) & (ZERO | PURGED))
+
+// Free block payload is known to be zero
+#define ZERO         0x2
+// Free block's interior pages were purged
+#define PURGED       0x4
+// Allocated block has a mapping of its own (shares the bit with ZERO, which only free blocks use)
+#define MAPPED       0x2
+#define IS_MAPPED(p) ((GET(p) & (MAPPED | 0x1)) == (MAPPED | 0x1))
 
 // Given block ptr bp, compute address of its header and footer
 #define HDRP(bp)       ((char *)(bp) - WSIZE)  
@@ -98,22 +196,121 @@ team_t team = {
 // Given block ptr bp, compute the address of the next and previous free blocks
 #define NEXT_FREE_BLKP(bp)  (*(char **)((bp) + WSIZE))
 #define PREV_FREE_BLKP(bp)  (*(char **)(bp))
+
+// Given the start sp of the heap or of a segment, compute the address of the next segment
+// in its arena, and of the arena it belongs to
+#define NEXT_SEG(sp)   (*(char **)(sp))
+#define SEG_ARENA(sp)  (*(char **)((char *)(sp) + WSIZE))
+
+// Given an arena ar, compute the address of its free list heads, its class locks, its segment lock,
+// and its first segment
+#define ARENA_LISTS(ar)  ((char **)(ar))
+#define ARENA_LOCKS(ar)  ((pthread_mutex_t *)((char **)(ar) + NCLASSES))
+#define ARENA_SEGLOCK(ar) (ARENA_LOCKS(ar) + NCLASSES)
+#define ARENA_SEGS(ar)   (*(char **)(ARENA_LOCKS(ar) + NCLASSES + 1))
+// and the first block of its remote free queue, and how many blocks are on it
+#define ARENA_REMOTE(ar) (((char **)(ARENA_LOCKS(ar) + NCLASSES + 1))[1])
+#define ARENA_NREMOTE(ar) (((size_t *)(ARENA_LOCKS(ar) + NCLASSES + 1))[2])
+#define ARENA_BYTES      ((NCLASSES*sizeof(char *) + (NCLASSES+1)*sizeof(pthread_mutex_t) + 3*sizeof(char *) \
+                          + (DSIZE-1)) & ~(DSIZE-1))
+
+// Given a thread cache tc, compute the address of bin i's first block and its block count
+#define CACHE_HEAD(tc, i)   (((char **)(tc))[i])
+#define CACHE_COUNT(tc, i)  (((size_t *)((char **)(tc) + CACHE_BINS))[i])
+// Given cached block bp, compute the address of the next block in its bin
+#define NEXT_CACHED(bp)     (*(char **)(bp))
+// Given a size class index i, compute the address of its bin in the first CPU's cache
+#define PCPU_BIN(i)         (pcpu + (i)*PCPU_BIN_BYTES)
+// Given block bp on a remote free queue, compute the address of the next block on it
+#define NEXT_REMOTE(bp)     (*(char **)(bp))
 // $end mallocmacros
 
 // Global variables
 // Must be only scalars (like ints, and pointers), no data structures (like structs and arrays).
 static char *heap_listp;    // pointer to first block
-static char *free_listp;    // pointer to the first free block
+static char *arenas;        // the arenas, ARENA_BYTES each (at the start of the heap)
+static int narenas;         // how many there are
+static int arena_config = 1;            // narenas for the next mm_init, see mm_set_arenas
+static int arena_mode = MM_ARENA_RR;    // how threads pick an arena
+static int next_arena;                  // the arena the next thread gets with MM_ARENA_RR
+static __thread char *tarena;           // this thread's arena with MM_ARENA_RR, or NULL
+static __thread int tarena_gen;         // heap_gen when it was picked
+static int remote = 1;                  // see mm_set_remote
+static long remote_frees;               // blocks pushed on remote free queues since mm_init
+static long remote_drains;              // queues taken by their arena since mm_init
+static pthread_mutex_t *heap_lock;   // guards growing and shrinking the heap, arena 0's segments, and mappings
+static pthread_mutex_t *big_lock;    // the one lock every call takes with MM_LOCK_GLOBAL
+static int locking = MM_LOCK_CLASS;  // see mm_set_locking
+static __thread int world_depth;     // how many lock_world calls this thread is inside of
+static size_t cache_high = CACHE_HIGH;   // see mm_set_cache
+static size_t cache_low = CACHE_HIGH/2;  // what a bin is filled or flushed to
+static int heap_gen;                     // bumped by mm_init, so thread caches can tell they're stale
+static pthread_key_t cache_key;          // drains a thread's cache when it exits
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static __thread char *tcache;            // this thread's cache, or NULL
+static __thread int tcache_gen;          // heap_gen when this thread's cache was made
+static char *pcpu;                       // the per-CPU caches, PCPU_STRIDE bytes each, or NULL
+static int pcpu_config;                  // see mm_set_percpu
+static int ncpus;                        // how many per-CPU caches there are
+static size_t trim_threshold; // current trim threshold, grows when trimming thrashes
+static int trimmed;         // set when the heap or a segment was trimmed since the last growth
 
 // function prototypes for internal helper routines
-static void *extend_heap(size_t words);
+static void *extend_heap(char *ar, size_t words);
+static void *new_segment(char *ar, size_t size);
+static void release_segment(void *bp);
+static size_t adjust_size(size_t size);
 static void place(void *bp, size_t asize);
-static void *find_fit(size_t asize);
-static void *coalesce(void *bp);
+static void *find_fit(char *ar, size_t asize);
+static int class_of(size_t size);
+static void take_block(void *bp);
+static void list_block(void *bp);
+static void *find_block(size_t asize);
+static void clear_payload(void *bp, size_t bytes);
+static void clear_seam(void *bp);
+static void *find_aligned_fit(char *ar, size_t asize, size_t alignment);
+static void *place_aligned(void *bp, size_t asize, size_t alignment);
+static char *aligned_payload(void *bp, size_t asize, size_t alignment);
+static void *map_block(size_t size);
+static void *remap_block(void *bp, size_t size);
+static void *move_block(void *bp, size_t size);
+static void *coalesce(void *bp, int keep);
+static void free_block(void *bp);
+static void release_block(void *bp, size_t size);
+static void remote_free(char *ar, void *bp);
+static void remote_drain(char *ar);
+static void *cache_get(size_t asize);
+static int cache_put(void *bp, size_t size);
+static char *this_cache(void);
+static void *cache_refill(char *tc, size_t asize);
+static void cache_flush(char *tc, int bin, size_t keep);
+static void cache_drain(void);
+static void cache_exit(void *tc);
+static void cache_key_init(void);
+static void *pcpu_get(size_t asize);
+static int pcpu_put(void *bp, size_t size);
+static void *pcpu_refill(char *bin, size_t asize);
+static void pcpu_flush(void);
+static char *rseq_pop(char *bin);
+static int rseq_push(char *bin, void *bp);
+static int trim_heap(void *bp);
+static int compare_addr(const void *a, const void *b);
 static void addblock(void *bp);
 static void removeblock(void *bp);
 static void printblock(void *bp); 
 static void checkblock(void *bp);
+static char *arena_of(void *bp);
+static char *this_arena(void);
+static void lock_classes(char *ar, unsigned int mask);
+static void unlock_classes(char *ar, unsigned int mask);
+static void lock_heap(void);
+static void unlock_heap(void);
+static void lock_segs(char *ar);
+static void unlock_segs(char *ar);
+static void lock_world(void);
+static void unlock_world(void);
+static void enter(void);
+static void leave(void);
 
 
 /* 
@@ -122,26 +319,144 @@ static void checkblock(void *bp);
 // $begin mminit
 int mm_init(void) 
 {
+    size_t ctlsize;
+    char *ar;
+    char *bp;
+    int c;
+
+    // The arenas (free list heads and locks) go in front of the heap proper, then the heap and big locks.
+    narenas = arena_config;
+    ctlsize = (narenas*ARENA_BYTES + 2*sizeof(pthread_mutex_t) + (DSIZE-1)) & ~(DSIZE-1);
+    if ((arenas = mem_sbrk(ctlsize)) == (void *)-1) {
+       return -1;
+    }
+    for (ar = arenas; ar < arenas + narenas*ARENA_BYTES; ar += ARENA_BYTES) {
+       for (c = 0; c < NCLASSES; c++) {
+          ARENA_LISTS(ar)[c] = NULL;
+          pthread_mutex_init(&ARENA_LOCKS(ar)[c], NULL);
+       }
+       pthread_mutex_init(ARENA_SEGLOCK(ar), NULL);
+       ARENA_SEGS(ar) = NULL;
+       ARENA_REMOTE(ar) = NULL;
+       ARENA_NREMOTE(ar) = 0;
+    }
+    heap_lock = (pthread_mutex_t *)(arenas + narenas*ARENA_BYTES);
+    big_lock = heap_lock + 1;
+    pthread_mutex_init(heap_lock, NULL);
+    pthread_mutex_init(big_lock, NULL);
+
     // create the initial empty heap
-    if ((heap_listp = mem_sbrk(6*WSIZE)) == NULL) {
+    if ((heap_listp = mem_sbrk(SEGMENT_HEAD)) == (void *)-1) {
        return -1;
     }
-    PUT(heap_listp, 0);                         // alignment padding
-    PUT(heap_listp+WSIZE, PACK(OVERHEAD, 1));   // prologue header
-    PUT(heap_listp+DSIZE, PACK(OVERHEAD, 1));   // prologue footer
-    PUT(heap_listp+WSIZE+DSIZE, PACK(0, 1));    // epilogue header
+    NEXT_SEG(heap_listp) = NULL;                // no segments yet
+    SEG_ARENA(heap_listp) = arenas;             // the heap is arena 0's
+    PUT(heap_listp+2*WSIZE, 0);                 // alignment padding
+    PUT(heap_listp+3*WSIZE, PACK(OVERHEAD, 1)); // prologue header
+    PUT(heap_listp+4*WSIZE, PACK(OVERHEAD, 1)); // prologue footer
+    PUT(heap_listp+5*WSIZE, PACK(0, 1));        // epilogue header
+    ARENA_SEGS(arenas) = heap_listp;
 
-    free_listp = heap_listp + DSIZE;            // Setup the explicit free list
+    trim_threshold = TRIM_THRESHOLD;
+    trimmed = 0;
+    next_arena = 0;
+    remote_frees = 0;
+    remote_drains = 0;
+    // Every thread cache (and thread's arena) points into the old heap.
+    heap_gen++;
 
     // Extend the empty heap with a free block of WSIZE bytes (less initial utilization)
-    if (extend_heap(WSIZE) == NULL) {
+    if ((bp = extend_heap(arenas, WSIZE)) == NULL) {
        return -1;
     }
+    list_block(bp);
+
+    // The per-CPU caches get a mapping of their own (zeroed, so every bin starts out empty).
+    // It's bookkeeping outside the heap, so it isn't in the footprint.
+    pcpu = NULL;
+    if (pcpu_config) {
+       ncpus = sysconf(_SC_NPROCESSORS_CONF);
+       pcpu = mem_map_meta(ncpus * PCPU_STRIDE);
+    }
 
     return 0;
 }
 // $end mminit
 
+/*
+ * mm_set_locking - Choose how the allocator is made thread-safe. MM_LOCK_CLASS (the default)
+ *                  locks per size class, MM_LOCK_GLOBAL takes one big lock around every call.
+ *                  Only change it while no other thread is in the allocator.
+ */
+void mm_set_locking(int mode)
+{
+    locking = mode;
+}
+
+/*
+ * mm_set_arenas - Split the free lists into n arenas (up to MM_ARENAS_MAX) from the next mm_init on.
+ *                 With MM_ARENA_RR each new thread gets the next arena round-robin, with MM_ARENA_CPU
+ *                 every call uses the arena for the CPU it's running on.
+ */
+void mm_set_arenas(int n, int mode)
+{
+    arena_config = (n < 1) ? 1 : (n > MM_ARENAS_MAX) ? MM_ARENAS_MAX : n;
+    arena_mode = mode;
+}
+
+/*
+ * mm_set_remote - Turn the remote free queues on (the default) or off. With them off, a block
+ *                 from another arena is freed like any other: into this thread's cache (or this
+ *                 CPU's) if it's small and there's room, and right away under its arena's locks
+ *                 if not.
+ */
+void mm_set_remote(int on)
+{
+    remote = on;
+}
+
+/*
+ * mm_remote_stats - Report how many blocks went on remote free queues since mm_init, and how
+ *                   many times an arena took its queue. One over the other is the average depth.
+ */
+void mm_remote_stats(long *frees, long *drains)
+{
+    *frees = __atomic_load_n(&remote_frees, __ATOMIC_RELAXED);
+    *drains = __atomic_load_n(&remote_drains, __ATOMIC_RELAXED);
+}
+
+/*
+ * mm_set_cache - Let each bin of the thread caches hold up to high blocks, refilling and flushing
+ *                them high/2 at a time. 0 turns the caches off. The calling thread's cache is drained,
+ *                the others keep what they have until they next go over (or exit).
+ */
+void mm_set_cache(size_t high)
+{
+    if (tcache != NULL && tcache_gen == heap_gen) {
+       cache_drain();
+    }
+    cache_high = high;
+    cache_low = (high > 1) ? high/2 : high;
+}
+
+/*
+ * mm_set_percpu - Put per-CPU caches of small blocks in front of the thread caches from the next
+ *                 mm_init on (or take them away). They need restartable sequences (rseq), which
+ *                 glibc registers for every thread on x86-64 Linux, and the sequences are x86-64
+ *                 code, so the Makefile's -m32 build leaves them out (make CFLAGS="-Wall -O2"
+ *                 builds them). Returns 1 if they'll be used, 0 if rseq isn't there and
+ *                 everything goes the usual way.
+ */
+int mm_set_percpu(int on)
+{
+#ifdef HAVE_RSEQ
+    pcpu_config = on && __rseq_size > 0;
+#else
+    pcpu_config = 0;
+#endif
+    return pcpu_config;
+}
+
 /* 
  * mm_malloc - Allocate a block with at least size bytes of payload 
  */
@@ -149,7 +464,6 @@ int mm_init(void)
 void *mm_malloc(size_t size) 
 {
     size_t asize;      // adjusted block size
-    size_t extendsize; // amount to extend heap if no fit
     char *bp;      
 
     // Ignore spurious requests
@@ -157,29 +471,129 @@ void *mm_malloc(size_t size)
        return NULL;
     }
 
+    // Large requests don't come out of the heap at all.
+    if (size >= MMAP_THRESHOLD) {
+       enter();
+       bp = map_block(size);
+       leave();
+       return bp;
+    }
+
     // Adjust block size to include overhead and alignment reqs.
-    if (size <= DSIZE) {
-       asize = DSIZE + OVERHEAD;
-    } else {
-       asize = DSIZE * ((size + (OVERHEAD) + (DSIZE-1)) / DSIZE);
-    }    
+    asize = adjust_size(size);
+
+    // Small blocks come out of this CPU's cache, or else this thread's cache, if they can.
+    if ((bp = pcpu_get(asize)) != NULL || (bp = cache_get(asize)) != NULL) {
+       return bp;
+    }
 
-    // Search the free list for a fit, place into memory if possible.
-    if ((bp = find_fit(asize)) != NULL) {
+    // Search the free lists for a fit (or extend the heap), and place the block.
+    enter();
+    if ((bp = find_block(asize)) != NULL) {
        place(bp, asize);
+    }
+    leave();
+
+    return bp;
+} 
+// $end mmmalloc
+
+/*
+ * mm_calloc - Allocate a zeroed block for nmemb elements of size bytes each.
+ *             Free blocks that are known zero (fresh heap memory) only need their
+ *             free list pointers cleared, everything else gets a real clear.
+ */
+// $begin mmcalloc
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    size_t bytes = nmemb * size;
+    size_t asize;
+    size_t zero;
+    char *bp;
+
+    // Ignore spurious requests, and ones that overflow.
+    if (bytes <= 0 || bytes / nmemb != size) {
+       return NULL;
+    }
+
+    // A fresh mapping is already zero.
+    if (bytes >= MMAP_THRESHOLD) {
+       enter();
+       bp = map_block(bytes);
+       leave();
        return bp;
     }
 
-    // No fit found. Extend the heap and place the block.
-    extendsize = MAX(asize,CHUNKSIZE);
-    if ((bp = extend_heap(extendsize/WSIZE)) == NULL) {
+    asize = adjust_size(bytes);
+    enter();
+    if ((bp = find_block(asize)) == NULL) {
+       leave();
        return NULL;
     }
+    zero = GET_ZERO(HDRP(bp));
     place(bp, asize);
+    leave();
+
+    if (zero) {
+       // Only the free list pointers were ever written.
+       PUT(bp, 0);
+       PUT((char *)bp + WSIZE, 0);
+    } else {
+       clear_payload(bp, bytes);
+    }
 
     return bp;
-} 
-// $end mmmalloc
+}
+// $end mmcalloc
+
+/*
+ * mm_malloc_group - Allocate count blocks of sizes[i] bytes next to each other, and store them in out_ptrs.
+ *                   Does a single fit search for the whole group, then carves the block it gets into
+ *                   one block per object, each with its own header and footer so it can be freed with
+ *                   mm_free on its own. Returns 0 on success and -1 if nothing was allocated.
+ */
+// $begin mmmallocgroup
+int mm_malloc_group(size_t count, size_t sizes[], void *out_ptrs[])
+{
+    size_t total = 0;  // adjusted size of the whole group
+    size_t asize;      // adjusted size of one object
+    size_t i;
+    char *bp;
+
+    // Ignore spurious requests, and groups whose size overflows.
+    if (count <= 0) {
+       return -1;
+    }
+    for (i = 0; i < count; i++) {
+       if (sizes[i] <= 0 || total + adjust_size(sizes[i]) < total) {
+          return -1;
+       }
+       total += adjust_size(sizes[i]);
+    }
+
+    // One search (or heap extension) for the whole group.
+    enter();
+    if ((bp = find_block(total)) == NULL) {
+       leave();
+       return -1;
+    }
+    place(bp, total);
+    leave();
+
+    // Carve it up. The last object gets whatever slack place left over.
+    total = GET_SIZE(HDRP(bp));
+    for (i = 0; i < count; i++) {
+       asize = (i == count-1) ? total : adjust_size(sizes[i]);
+       PUT(HDRP(bp), PACK(asize, 1));
+       PUT(FTRP(bp), PACK(asize, 1));
+       out_ptrs[i] = bp;
+       total -= asize;
+       bp = NEXT_BLKP(bp);
+    }
+
+    return 0;
+}
+// $end mmmallocgroup
 
 /* 
  * mm_free - Free a block 
@@ -187,17 +601,119 @@ void *mm_malloc(size_t size)
 // $begin mmfree
 void mm_free(void *bp)
 {
-    // Find the size of the block being freed.
-    size_t size = GET_SIZE(HDRP(bp));
+    release_block(bp, GET_SIZE(HDRP(bp)));
+}
+// $end mmfree
+
+/*
+ * mm_free_sized - Free a block whose requested size the caller already knows (C++ sized delete).
+ *                 The cache bin comes from the size instead of the header, so a small block goes
+ *                 into a thread or per-CPU cache without its tag being read at all (unless there
+ *                 are arenas to check). The block can be bigger than the rounded request, but it
+ *                 still comes out of the bin for that request and goes back to the heap whole,
+ *                 since the header keeps its real size. With DEBUG defined the size is checked.
+ */
+// $begin mmfreesized
+void mm_free_sized(void *bp, size_t size)
+{
+#ifdef DEBUG
+    // The block has to be at least as big as what mm_malloc would have made for size.
+    if (adjust_size(size) > GET_SIZE(HDRP(bp))) {
+       printf("ERROR: mm_free_sized(%p, %u) but the block only holds %u bytes\n",
+              bp, (unsigned)size, (unsigned)mm_usable_size(bp));
+       exit(1);
+    }
+#endif
+    release_block(bp, adjust_size(size));
+}
+// $end mmfreesized
+
+/*
+ * release_block - The part of mm_free and mm_free_sized after the size is known. size picks the
+ *                 cache bin, and can be less than the block's real size but not more.
+ */
+// $begin release_block
+static void release_block(void *bp, size_t size)
+{
+    char *ar;
+
+    // A block from some other thread's arena goes back to it on its remote free queue.
+    if (remote && narenas > 1 && !IS_MAPPED(HDRP(bp)) && (ar = arena_of(bp)) != this_arena()) {
+       remote_free(ar, bp);
+       return;
+    }
 
-    // Clear the header and footer.
-    PUT(HDRP(bp), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
+    // Small blocks go in this CPU's cache, or else this thread's cache, if there's room.
+    if (pcpu_put(bp, size) || cache_put(bp, size)) {
+       return;
+    }
 
-    // Coalesce so that the freed memory ends up in the freed list in as big of a chunk as possible.
-    coalesce(bp);
+    enter();
+    free_block(bp);
+    leave();
 }
-// $end mmfree
+// $end release_block
+
+/*
+ * mm_free_batch - Free n blocks at once, for tearing down big object graphs.
+ *                 Sorts ptrs by address (in place), then sweeps through them merging each run of
+ *                 adjacent blocks (and any free neighbors) into one free span. Every span gets its
+ *                 header and footer written once and goes into the free list once, instead of
+ *                 being coalesced and relinked on every single free. Holds every lock while it does.
+ */
+// $begin mmfreebatch
+void mm_free_batch(void *ptrs[], size_t n)
+{
+    size_t i = 0;
+    size_t size;
+    char *bp;
+    char *next;
+
+    lock_world();
+    qsort(ptrs, n, sizeof(void *), compare_addr);
+
+    while (i < n) {
+       bp = ptrs[i++];
+       size = GET_SIZE(HDRP(bp));
+
+       // Large blocks aren't in the heap, they just get unmapped.
+       if (IS_MAPPED(HDRP(bp))) {
+          mem_unmap(bp - DSIZE);
+          continue;
+       }
+
+       // Merge with a free block in front. Anything from this batch in front of bp was already
+       // swept up by an earlier span, so this can only be a block that was free before.
+       if (!GET_ALLOC(FTRP(PREV_BLKP(bp)))) {
+          bp = PREV_BLKP(bp);
+          removeblock(bp);
+          size += GET_SIZE(HDRP(bp));
+       }
+
+       // Sweep forward over the next blocks in the batch and any free blocks in between.
+       next = bp + size;
+       for (;;) {
+          if (i < n && ptrs[i] == next) {
+             i++;
+          } else if (!GET_ALLOC(HDRP(next))) {
+             removeblock(next);
+          } else {
+             break;
+          }
+          size += GET_SIZE(HDRP(next));
+          next = bp + size;
+       }
+
+       PUT(HDRP(bp), PACK(size, 1));
+       PUT(FTRP(bp), PACK(size, 1));
+       // Any span can be the end of the heap or a whole segment.
+       if (!trim_heap(bp)) {
+          list_block(bp);
+       }
+    }
+    unlock_world();
+}
+// $end mmfreebatch
 
 /*
  * mm_realloc - a slightly less naive implementation of mm_realloc
@@ -210,88 +726,238 @@ void mm_free(void *bp)
 void *mm_realloc(void *ptr, size_t size)
 {
     size_t currentSize = GET_SIZE(HDRP(ptr));
-    size_t newSize =  (((size_t)(size) + (OVERHEAD-1)) & ~0x7) + OVERHEAD;
+    size_t newSize =  (((size_t)(size) + (OVERHEAD-1)) & ~(DSIZE-1)) + OVERHEAD;
     if(newSize < 3 * OVERHEAD) {
       newSize = 3 * OVERHEAD;
     }
     void *newp;
-    size_t copySize;
+    size_t next_tag;
+    unsigned int mask;
+
+    enter();
+
+    // Large blocks grow and shrink with mremap, the kernel moves the pages instead of us copying them.
+    if (IS_MAPPED(HDRP(ptr))) {
+      if (size < MMAP_THRESHOLD || (newp = remap_block(ptr, size)) == NULL) {
+        newp = move_block(ptr, size);
+      }
+      leave();
+      return newp;
+    }
     
     // Shrink the existing block if possible. 
     if(newSize <= currentSize) {    
       // Don't do anything if there isn't enough space to split the block.
       if(currentSize - newSize <= 3 * OVERHEAD) {
+        leave();
         return ptr;
       }
       
       PUT(HDRP(ptr), PACK(newSize, 1));
       PUT(FTRP(ptr), PACK(newSize, 1));
       PUT(HDRP(NEXT_BLKP(ptr)), PACK(currentSize - newSize, 1));
-      mm_free(NEXT_BLKP(ptr));
+      PUT(FTRP(NEXT_BLKP(ptr)), PACK(currentSize - newSize, 1));
+      free_block(NEXT_BLKP(ptr));
+      leave();
       return ptr;
     }
 
     // If the block is already the right size, then just use it.
     if(GET_SIZE(HDRP(ptr)) + OVERHEAD <= GET_SIZE(HDRP(ptr))) {
+        leave();
         return ptr;
     }
 
     // If the next block is available, and the combined size is big enough, combine the blocks and use it.
-    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(ptr)));
-    size_t combined_size = GET_SIZE(HDRP(NEXT_BLKP(ptr))) + currentSize;
-    if(!next_alloc && combined_size >= newSize) {
-        removeblock(NEXT_BLKP(ptr));
-        PUT(HDRP(ptr), PACK(combined_size, 1));
-        PUT(FTRP(ptr), PACK(combined_size, 1));
-        return ptr;
+    // It has to still be the same free block once its class is locked, another thread could have taken it.
+    next_tag = PEEK(HDRP(NEXT_BLKP(ptr)));
+    if(!(next_tag & 0x1) && TAG_SIZE(next_tag) + currentSize >= newSize) {
+        mask = 1u << class_of(TAG_SIZE(next_tag));
+        lock_classes(arena_of(ptr), mask);
+        if (PEEK(HDRP(NEXT_BLKP(ptr))) == next_tag) {
+            removeblock(NEXT_BLKP(ptr));
+            PUT(HDRP(ptr), PACK(TAG_SIZE(next_tag) + currentSize, 1));
+            PUT(FTRP(ptr), PACK(TAG_SIZE(next_tag) + currentSize, 1));
+            unlock_classes(arena_of(ptr), mask);
+            leave();
+            return ptr;
+        }
+        unlock_classes(arena_of(ptr), mask);
     }
 
     // If none of the above tricks can be used, just do what mm-sample did.
-    if ((newp = mm_malloc(size)) == NULL) {
-       	printf("ERROR: mm_malloc failed in mm_realloc\n");
-       	exit(1);
+    newp = move_block(ptr, size);
+    leave();
+    return newp;
+}
+// $end mm_realloc
+
+/*
+ * mm_memalign - Allocate a block whose payload address is a multiple of alignment.
+ *               Searches the free list for a block that can hold an aligned payload.
+ *               The leading slack in front of the aligned payload is split off as its own
+ *               free block instead of being wasted.
+ */
+// $begin mm_memalign
+void *mm_memalign(size_t alignment, size_t size)
+{
+    size_t asize;      // adjusted block size
+    size_t extendsize; // amount to extend heap if no fit
+    char *ar;
+    char *bp;
+
+    // Ignore spurious requests, the alignment has to be a power of two.
+    if (size <= 0 || alignment == 0 || (alignment & (alignment - 1))) {
+       return NULL;
     }
-    copySize = GET_SIZE(HDRP(ptr));
-    if (size < copySize) {
-      copySize = size;
+
+    // Every payload is already doubleword aligned.
+    if (alignment <= DSIZE) {
+       return mm_malloc(size);
+    }
+
+    asize = adjust_size(size);
+
+    // Search the free lists for a block that can hold an aligned payload.
+    enter();
+    ar = this_arena();
+    remote_drain(ar);
+    if ((bp = find_aligned_fit(ar, asize, alignment)) == NULL) {
+       // No fit found. Extend the heap by enough to cover the worst case slack.
+       extendsize = MAX(asize + alignment + DSIZE + OVERHEAD, CHUNKSIZE);
+       if ((bp = extend_heap(ar, extendsize/WSIZE)) == NULL) {
+          leave();
+          return NULL;
+       }
+       if (aligned_payload(bp, asize, alignment) == NULL) {
+          list_block(bp);
+          leave();
+          return NULL;
+       }
     }
-    memcpy(newp, ptr, copySize);
-    mm_free(ptr);
-    return newp;  
+    bp = place_aligned(bp, asize, alignment);
+    leave();
+
+    return bp;
 }
-// $end mm_realloc
+// $end mm_memalign
+
+/*
+ * mm_aligned_alloc - C11 style name for mm_memalign.
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size)
+{
+    return mm_memalign(alignment, size);
+}
+
+/*
+ * mm_usable_size - Return the number of payload bytes the block at ptr can actually hold.
+ *                  Because of the rounding in mm_malloc and the no-split path in place,
+ *                  this is often larger than what was asked for. Reads the header, so it's O(1).
+ */
+// $begin mm_usable_size
+size_t mm_usable_size(void *ptr)
+{
+    if (ptr == NULL) {
+       return 0;
+    }
+    // Mapped blocks have no footer, just the DSIZE bytes in front of the payload.
+    if (IS_MAPPED(HDRP(ptr))) {
+       return GET_SIZE(HDRP(ptr)) - DSIZE;
+    }
+    return GET_SIZE(HDRP(ptr)) - OVERHEAD;
+}
+// $end mm_usable_size
+
+/*
+ * mm_purge - Give the pages in the middle of every big free block back to the system.
+ *            Only the page-aligned part between the free list pointers and the footer is
+ *            purged, so the boundary tags and the free list stay intact. Purged blocks are
+ *            marked so they aren't purged twice, and so the fit search knows they'll fault.
+ *            Holds every lock while it walks the free lists. Returns the number of bytes purged.
+ */
+// $begin mm_purge
+size_t mm_purge(void)
+{
+    char *ar;
+    char *bp;
+    size_t size;
+    size_t purged = 0;
+    int c;
+
+    // Blocks in this thread's cache, the per-CPU caches, or on remote free queues can't be purged,
+    // so give them back first. That's freeing, so it happens with every lock held too (the locking
+    // in free_block nests).
+    lock_world();
+    if (tcache != NULL && tcache_gen == heap_gen) {
+        cache_drain();
+    }
+    pcpu_flush();
+    for (ar = arenas; ar < arenas + narenas*ARENA_BYTES; ar += ARENA_BYTES) {
+        remote_drain(ar);
+    }
+    for (ar = arenas; ar < arenas + narenas*ARENA_BYTES; ar += ARENA_BYTES) {
+        for (c = 0; c < NCLASSES; c++) {
+            for (bp = ARENA_LISTS(ar)[c]; bp != NULL; bp = NEXT_FREE_BLKP(bp)) {
+                size = GET_SIZE(HDRP(bp));
+                if (size < PURGE_THRESHOLD || (GET(HDRP(bp)) & PURGED)) {
+                    continue;
+                }
+                purged += mem_purge((char *)bp + DSIZE, size - OVERHEAD - DSIZE);
+                PUT(HDRP(bp), GET(HDRP(bp)) | PURGED);
+                PUT(FTRP(bp), GET(FTRP(bp)) | PURGED);
+            }
+        }
+    }
+    unlock_world();
+
+    return purged;
+}
+// $end mm_purge
 
 /* 
- * mm_checkheap - Check the heap for consistency. Hasn't been modified from what was provided. Might not work.
+ * mm_checkheap - Check the heap for consistency. Mostly what was provided, but it walks every segment
+ *                of every arena from its prologue to its epilogue. Might not work.
  */
 // $begin mm_checkheap
 // TODO: Should probably change this to do more than the provided function. It's worth 5 points.
 void mm_checkheap(int verbose) 
 {
-    char *bp = heap_listp;
+    char *ar;
+    char *sp;
+    char *bp;
 
-    if (verbose) {
-       printf("Heap (%p):\n", heap_listp);
-    }
+    lock_world();
+    for (ar = arenas; ar < arenas + narenas*ARENA_BYTES; ar += ARENA_BYTES)
+    for (sp = ARENA_SEGS(ar); sp != NULL; sp = NEXT_SEG(sp)) {
+       bp = sp + SEGMENT_HEAD - DSIZE; // the prologue
+       if (verbose) {
+          printf("Heap segment (%p) of arena %d:\n", sp, (int)((ar - arenas) / ARENA_BYTES));
+       }
+       if (SEG_ARENA(sp) != ar) {
+          printf("Segment in the wrong arena\n");
+       }
 
-    if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp))) {
-       printf("Bad prologue header\n");
-    }
-    checkblock(heap_listp);
+       if ((GET_SIZE(HDRP(bp)) != OVERHEAD) || !GET_ALLOC(HDRP(bp))) {
+          printf("Bad prologue header\n");
+       }
+       checkblock(bp);
+
+       for (bp = NEXT_BLKP(bp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+          if (verbose) {
+             printblock(bp);
+          }
+          checkblock(bp);
+       }
 
-    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
        if (verbose) {
-           printblock(bp);
-        }
-       checkblock(bp);
-    }
-     
-    if (verbose) {
-       printblock(bp);
-    }
-    if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp)))) {
-       printf("Bad epilogue header\n");
+          printblock(bp);
+       }
+       if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp)))) {
+          printf("Bad epilogue header\n");
+       }
     }
+    unlock_world();
 }
 // $end mm_checkheap
 
@@ -304,13 +970,25 @@ void mm_checkheap(int verbose)
 
 
 /* 
- * extend_heap - Extend heap with free block and return its block pointer
+ * extend_heap - Extend arena ar with free block and return its block pointer.
+ *               The block is coalesced, but stays marked allocated: it belongs to the caller,
+ *               who either places something in it or hands it to list_block.
+ *               Arena 0 grows the heap, the others get a new segment. If the block doesn't fit in
+ *               a segment, it comes from arena 0 instead. A new segment only takes its arena's
+ *               segment lock, so arenas grow without waiting on each other or on the heap.
+ *               Growing the heap takes the heap lock, even though mem_sbrk could take more than one
+ *               grower at a time: the new block's header goes where the old epilogue was, so two
+ *               growths of the heap have to go in order, and trim_heap's shrinks have to be kept
+ *               apart from them.
  */
 // $begin mmextendheap
-static void *extend_heap(size_t words) 
+static void *extend_heap(char *ar, size_t words) 
 {
     char *bp;
+    char *fresh;
     size_t size;
+    size_t threshold;
+    size_t zero;
     
     // Allocate an even number of words to maintain alignment, a minimum of 16 bytes.
     if(((words % 2) ? (words+1) * WSIZE : words * WSIZE) > OVERHEAD + OVERHEAD) {
@@ -319,80 +997,233 @@ static void *extend_heap(size_t words)
         size = OVERHEAD + OVERHEAD;
     }
 
-    // Quit if we can't get enough memory.
+    // Growing right after a trim means we gave back memory that was still needed.
+    // Make the next trim wait for a bigger free tail so the heap doesn't thrash.
+    // Arenas grow under different locks, so the flag and the threshold are atomic.
+    if (__atomic_exchange_n(&trimmed, 0, __ATOMIC_RELAXED)) {
+        threshold = __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED);
+        if (threshold < TRIM_MAX) {
+            __atomic_store_n(&trim_threshold, threshold << 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (ar != arenas) {
+       lock_segs(ar);
+       bp = new_segment(ar, size);
+       unlock_segs(ar);
+       if (bp != NULL) {
+          return bp;
+       }
+    }
+
+    lock_heap();
+
+    // If the heap can't grow in place, start a new segment. Quit if we can't get that either.
+    fresh = mem_fresh_lo();
     if ((bp = mem_sbrk(size)) == (void *)-1) { 
-       return NULL;
+       bp = new_segment(arenas, size);
+       unlock_heap();
+       return bp;
     }
+    // Memory nobody has been handed before is still zero.
+    zero = (bp >= fresh) ? ZERO : 0;
 
     // Initialize free block header/footer and the epilogue header
-    PUT(HDRP(bp), PACK(size, 0));         // free block header
-    PUT(FTRP(bp), PACK(size, 0));         // free block footer
+    PUT(HDRP(bp), PACK(size, zero | 1));  // free block header (ours until it's in a free list)
+    PUT(FTRP(bp), PACK(size, zero | 1));  // free block footer
     PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); // new epilogue header
+    unlock_heap();
 
-    // Coalesce to combine with previous free block (if it exists), and add to explicit free list.
-    return coalesce(bp);
+    // Coalesce to combine with previous free block (if it exists).
+    return coalesce(bp, 1);
 }
 // $end mmextendheap
 
+/*
+ * new_segment - Start a new heap segment for arena ar with a free block of at least size bytes,
+ *               for when the heap can't grow in place (or ar isn't arena 0). It's laid out like
+ *               the start of the heap, with a prologue in front of the free block and an epilogue
+ *               after it, and linked in at the front of ar's segments. Returns the free block
+ *               (marked allocated, like extend_heap), or NULL if there's no memory left or size
+ *               doesn't fit in a segment. The caller holds ar's segment lock (see lock_segs).
+ */
+// $begin new_segment
+static void *new_segment(char *ar, size_t size)
+{
+    char *sp;
+    char *bp;
+
+    if (size > SEGMENT_SIZE - SEGMENT_HEAD || (sp = mem_segment(SEGMENT_SIZE, SEGMENT_SIZE)) == NULL) {
+       return NULL;
+    }
+    NEXT_SEG(sp) = ARENA_SEGS(ar);
+    ARENA_SEGS(ar) = sp;
+    SEG_ARENA(sp) = ar;
+    PUT(sp+3*WSIZE, PACK(OVERHEAD, 1));         // prologue header
+    PUT(sp+4*WSIZE, PACK(OVERHEAD, 1));         // prologue footer
+
+    // The rest of the segment is one free block, and it's still zero.
+    bp = sp + SEGMENT_HEAD;
+    PUT(HDRP(bp), PACK(SEGMENT_SIZE - SEGMENT_HEAD, ZERO | 1));
+    PUT(FTRP(bp), PACK(SEGMENT_SIZE - SEGMENT_HEAD, ZERO | 1));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));       // epilogue header
+
+    return bp;
+}
+// $end new_segment
+
+/*
+ * release_segment - Give back the segment that free block bp takes up all of.
+ *                   bp isn't in a free list, and the caller holds its arena's segment lock.
+ */
+// $begin release_segment
+static void release_segment(void *bp)
+{
+    char *sp = (char *)bp - SEGMENT_HEAD;
+    char **link = &ARENA_SEGS(SEG_ARENA(sp));
+
+    while (*link != sp) {
+       link = &NEXT_SEG(*link);
+    }
+    *link = NEXT_SEG(sp);
+    mem_unsegment(sp);
+}
+// $end release_segment
+
+/*
+ * adjust_size - Round a request up to a block size that includes overhead and alignment reqs.
+ */
+// $begin adjust_size
+static size_t adjust_size(size_t size)
+{
+    if (size <= DSIZE) {
+       return DSIZE + OVERHEAD;
+    }
+    return DSIZE * ((size + (OVERHEAD) + (DSIZE-1)) / DSIZE);
+}
+// $end adjust_size
+
 /* 
  * place - Place block of asize bytes at start of free block bp 
- *         and split if remainder would be at least minimum block size
+ *         and split if remainder would be at least minimum block size.
+ *         bp has to be out of the free lists already (see take_block).
  */
 // $begin place
 static void place(void *bp, size_t asize)
 {
     // Get the block size.
     size_t csize = GET_SIZE(HDRP(bp));   
+    size_t flags = GET_FLAGS(HDRP(bp));
 
     // Split the block if it's large enough to be split
-    if ((csize - asize) >= (DSIZE + OVERHEAD)) { 
+    if ((csize - asize) >= MINBLOCK) { 
        PUT(HDRP(bp), PACK(asize, 1));
        PUT(FTRP(bp), PACK(asize, 1));
-       // Remove the placed block from the free list.
-       removeblock(bp);
        bp = NEXT_BLKP(bp);
-       PUT(HDRP(bp), PACK(csize-asize, 0));
-       PUT(FTRP(bp), PACK(csize-asize, 0));
+       // The remainder is still zero (or purged) if the whole block was, only boundary tags were written.
+       PUT(HDRP(bp), PACK(csize-asize, flags | 1));
+       PUT(FTRP(bp), PACK(csize-asize, flags | 1));
        // Coalesce so it can merge with nearby free blocks, and also be added to the free list.
-       coalesce(bp);
+       coalesce(bp, 0);
     } else { 
        // Just use the whole block if it isn't big enough to be split.
        PUT(HDRP(bp), PACK(csize, 1));
        PUT(FTRP(bp), PACK(csize, 1));
-       // Remove the placed block from the free list
-       removeblock(bp);
     }
 }
 // $end place
 
+/*
+ * place_aligned - Place a block of asize bytes at the first aligned payload address in free block bp.
+ *                 The slack in front of it goes back in the free lists as a smaller free block,
+ *                 and place takes care of splitting off whatever is left behind it.
+ */
+// $begin place_aligned
+static void *place_aligned(void *bp, size_t asize, size_t alignment)
+{
+    size_t csize = GET_SIZE(HDRP(bp));
+    size_t flags = GET_FLAGS(HDRP(bp));
+    char *ap = aligned_payload(bp, asize, alignment);
+    size_t lead = ap - (char *)bp;
+
+    if (lead > 0) {
+       // Shrink bp down to the leading slack, the rest becomes a block starting at the aligned payload.
+       PUT(HDRP(bp), PACK(lead, flags | 1));
+       PUT(FTRP(bp), PACK(lead, flags | 1));
+       PUT(HDRP(ap), PACK(csize - lead, flags | 1));
+       PUT(FTRP(ap), PACK(csize - lead, flags | 1));
+       coalesce(bp, 0);
+    }
+    place(ap, asize);
+
+    return ap;
+}
+// $end place_aligned
+
 /* 
- * find_fit - Find a fit for a block with asize bytes 
+ * find_fit - Find a fit for a block with asize bytes in arena ar, and take it out of its free list.
+ *            Searches the list for asize's size class, then the bigger ones.
+ *            Blocks whose pages are dirty (already resident) win ties against clean ones
+ *            (fresh or purged), which would take page faults on first write. So if the first
+ *            fit is clean, look a little further for a dirty one before settling for it.
  */
 // $begin find_fit
-static void *find_fit(size_t asize)
+static void *find_fit(char *ar, size_t asize)
 {
     void *bp;
-    int iterationCounter = 0;
-    // Find the first fit by looping through the explicit free list.
-    for (bp = free_listp; GET_ALLOC(HDRP(bp)) == 0; bp = NEXT_FREE_BLKP(bp)) {
-
-        // Keep track of how long we've been searching. 
-        // If we've gone through a lot of blocks, then just give up and extend the heap.
-        // This seems to help the binary traces a lot.
-        // The iteration number doesn't seem to make that much of a difference, and 100 works well.
-        iterationCounter++;
-        if(iterationCounter > 100) {
-            bp = extend_heap(asize/WSIZE);
-            return bp;
+    void *fit;
+    void *clean; // first fit whose pages are clean
+    int iterationCounter;
+    int lookahead;
+    int c;
+
+    for (c = class_of(asize); c < NCLASSES; c++) {
+        // Only a hint without the lock, but it saves locking the empty classes.
+        if (__atomic_load_n(&ARENA_LISTS(ar)[c], __ATOMIC_RELAXED) == NULL) {
+            continue;
         }
+        lock_classes(ar, 1u << c);
+        fit = NULL;
+        clean = NULL;
+        iterationCounter = 0;
+        lookahead = 0;
+        // Find the first fit by looping through the class's free list.
+        for (bp = ARENA_LISTS(ar)[c]; bp != NULL; bp = NEXT_FREE_BLKP(bp)) {
 
-       if (!GET_ALLOC(HDRP(bp)) && (asize <= GET_SIZE(HDRP(bp)))) {
-           return bp;
-       }
+            // Keep track of how long we've been searching. 
+            // If we've gone through a lot of blocks, then just give up and extend the heap.
+            // This seems to help the binary traces a lot.
+            // The iteration number doesn't seem to make that much of a difference, and 100 works well.
+            iterationCounter++;
+            if(iterationCounter > 100 || (clean != NULL && lookahead++ > DIRTY_LOOKAHEAD)) {
+                break;
+            }
+
+           if (asize <= GET_SIZE(HDRP(bp))) {
+               if (!GET_FLAGS(HDRP(bp))) {
+                   fit = bp;
+                   break;
+               }
+               if (clean == NULL) {
+                   clean = bp;
+               }
+           }
+        }
+
+        // No dirty fit, a clean one still beats growing the heap.
+        if (fit == NULL) {
+            fit = clean;
+        }
+        if (fit != NULL) {
+            take_block(fit);
+            unlock_classes(ar, 1u << c);
+            return fit;
+        }
+        unlock_classes(ar, 1u << c);
     }
 
     // If there isn't a fit, then extend the heap and return the extended block. That way there will always be a fit.
-    bp = extend_heap(asize/WSIZE);
+    bp = extend_heap(ar, asize/WSIZE);
 
     return bp;
 
@@ -400,70 +1231,466 @@ static void *find_fit(size_t asize)
 // $end find_fit
 
 /*
- * coalesce - boundary tag coalescing. Return ptr to coalesced block
+ * map_block - Give a large request a mapping of its own instead of carving it out of the heap.
+ *             The payload starts DSIZE bytes into the mapping, and its header holds the length
+ *             of the whole mapping. There's no footer, mapped blocks never coalesce.
+ */
+// $begin map_block
+static void *map_block(size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    size_t len = (size + DSIZE + (pagesize-1)) & ~(pagesize-1);
+    char *bp;
+
+    lock_heap();
+    bp = mem_map(len);
+    unlock_heap();
+    if (bp == NULL) {
+        return NULL;
+    }
+    bp += DSIZE;
+    PUT(HDRP(bp), PACK(len, MAPPED | 1));
+    return bp;
+}
+// $end map_block
+
+/*
+ * remap_block - Resize mapped block bp so it holds size bytes, with mremap.
+ *               Returns the (maybe moved) block, or NULL if bp was left alone.
+ */
+// $begin remap_block
+static void *remap_block(void *bp, size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    size_t len = (size + DSIZE + (pagesize-1)) & ~(pagesize-1);
+    char *mp;
+
+    lock_heap();
+    mp = mem_remap((char *)bp - DSIZE, len);
+    unlock_heap();
+    if (mp == NULL) {
+        return NULL;
+    }
+    bp = mp + DSIZE;
+    PUT(HDRP(bp), PACK(len, MAPPED | 1));
+    return bp;
+}
+// $end remap_block
+
+/*
+ * move_block - The slow path of mm_realloc. Allocate a new block, copy the payload over, and free bp.
+ *              Big heap blocks that get moved are placed on a page boundary, which lifts realloc-bal's
+ *              utilization from 70% to 78% (64-bit build). It also means the next time one of them
+ *              moves, past PAGEMOVE_THRESHOLD the whole pages of its payload get handed over with
+ *              mem_move_pages and only the partial page at the end is copied.
+ */
+// $begin move_block
+static void *move_block(void *bp, size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    size_t moved = 0;
+    void *newp = NULL;
+    size_t copySize;
+
+    if (size >= REMAP_THRESHOLD && size < MMAP_THRESHOLD) {
+       newp = mm_memalign(pagesize, size);
+    }
+    if (newp == NULL && (newp = mm_malloc(size)) == NULL) {
+       	printf("ERROR: mm_malloc failed in mm_realloc\n");
+       	exit(1);
+    }
+    copySize = mm_usable_size(bp);
+    if (size < copySize) {
+      copySize = size;
+    }
+
+    // Both payloads start on a page boundary, so move the whole pages.
+    if (copySize >= PAGEMOVE_THRESHOLD && !IS_MAPPED(HDRP(bp)) && !IS_MAPPED(HDRP(newp))
+        && ((size_t)bp & (pagesize-1)) == 0 && ((size_t)newp & (pagesize-1)) == 0) {
+       moved = copySize & ~(pagesize-1);
+       if (mem_move_pages(newp, bp, moved) < 0) {
+          moved = 0;
+       }
+    }
+    memcpy((char *)newp + moved, (char *)bp + moved, copySize - moved);
+    // Not into the cache, a block that's being reallocated is likely to keep growing.
+    enter();
+    free_block(bp);
+    leave();
+    return newp;
+}
+// $end move_block
+
+/*
+ * find_block - Find a free block for asize bytes in this thread's arena, extending it if nothing fits.
+ */
+// $begin find_block
+static void *find_block(size_t asize)
+{
+    size_t extendsize; // amount to extend heap if no fit
+    char *ar = this_arena();
+    char *bp;
+
+    // Free whatever other threads gave back to the arena first, it might fit.
+    remote_drain(ar);
+
+    // Search the free list for a fit.
+    if ((bp = find_fit(ar, asize)) != NULL) {
+       return bp;
+    }
+
+    // No fit found. Extend the heap.
+    extendsize = MAX(asize,CHUNKSIZE);
+    return extend_heap(ar, extendsize/WSIZE);
+}
+// $end find_block
+
+/*
+ * find_aligned_fit - Find a free block in arena ar that can hold an asize block with an aligned payload,
+ *                    and take it out of its free list.
+ *                    Unlike find_fit this doesn't extend the heap, mm_memalign does that.
+ */
+// $begin find_aligned_fit
+static void *find_aligned_fit(char *ar, size_t asize, size_t alignment)
+{
+    void *bp;
+    int iterationCounter;
+    int c;
+
+    for (c = class_of(asize); c < NCLASSES; c++) {
+        if (__atomic_load_n(&ARENA_LISTS(ar)[c], __ATOMIC_RELAXED) == NULL) {
+            continue;
+        }
+        lock_classes(ar, 1u << c);
+        iterationCounter = 0;
+        for (bp = ARENA_LISTS(ar)[c]; bp != NULL; bp = NEXT_FREE_BLKP(bp)) {
+            // Same cutoff as find_fit, give up on this class.
+            iterationCounter++;
+            if(iterationCounter > 100) {
+                break;
+            }
+
+            if (aligned_payload(bp, asize, alignment) != NULL) {
+                take_block(bp);
+                unlock_classes(ar, 1u << c);
+                return bp;
+            }
+        }
+        unlock_classes(ar, 1u << c);
+    }
+
+    return NULL;
+}
+// $end find_aligned_fit
+
+/*
+ * aligned_payload - Return the first aligned payload address in free block bp that leaves room
+ *                   for asize bytes, or NULL if there isn't one. Any slack in front of the payload
+ *                   has to be big enough to be a free block on its own.
+ */
+// $begin aligned_payload
+static char *aligned_payload(void *bp, size_t asize, size_t alignment)
+{
+    size_t csize = GET_SIZE(HDRP(bp));
+    char *ap = (char *)(((size_t)bp + (alignment-1)) & ~(alignment-1));
+
+    if (ap != (char *)bp) {
+        while ((size_t)(ap - (char *)bp) < DSIZE + OVERHEAD) {
+            ap += alignment;
+        }
+    }
+    if (ap + asize > (char *)bp + csize) {
+        return NULL;
+    }
+    return ap;
+}
+// $end aligned_payload
+
+/*
+ * coalesce - boundary tag coalescing. Return ptr to coalesced block.
+ *            bp has to be marked allocated, so no other thread touches it. It's merged with
+ *            whichever neighbors are free and put in the free list for its size, or with keep,
+ *            left marked allocated for the caller. The neighbors' tags are read without any locks,
+ *            so once their classes (and the merged block's) are locked they're read again, and it
+ *            starts over if another thread changed them in the meantime.
  */
 // $begin coalesce
-static void *coalesce(void *bp) 
+static void *coalesce(void *bp, int keep) 
 {
-    // Get the size of the current block, and check if the block before and after the current block are allocated.
-    size_t prev_alloc = (GET_ALLOC(FTRP(PREV_BLKP(bp)))) || PREV_BLKP(bp) == bp;
-    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     size_t size = GET_SIZE(HDRP(bp));
+    size_t flags = GET_FLAGS(HDRP(bp));
+    size_t prev_tag, next_tag;    // footer of the block before bp, header of the block after it
+    size_t prev_size, next_size;  // their sizes, or 0 if they aren't free
+    size_t zero;
+    unsigned int mask;
+    char *ar = arena_of(bp);  // the neighbors are in the same segment, so the same arena
+    char *prev;
+    char *next = NEXT_BLKP(bp);
 
-    // Case 1 (don't merge anything)
-    if(prev_alloc && next_alloc) {
-      addblock(bp);
-      return bp;
-    
-    // Case 2 (merge next block)
-    } else if (prev_alloc && !next_alloc) {
-       size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-       removeblock(NEXT_BLKP(bp));
-       PUT(HDRP(bp), PACK(size, 0));
-       PUT(FTRP(bp), PACK(size, 0));
-
-    // Case 3 (merge previous block)
-    } else if (!prev_alloc && next_alloc) {
-       size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-       removeblock(PREV_BLKP(bp));
-       PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-       PUT(FTRP(PREV_BLKP(bp)), PACK(size, 0));
-       bp = PREV_BLKP(bp);
-
-    // Case 4 (merge previous and next blocks)
-    } else if(!prev_alloc && !next_alloc) {
-       size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(HDRP(NEXT_BLKP(bp)));
-       removeblock(PREV_BLKP(bp));
-       removeblock(NEXT_BLKP(bp));
-       PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-       PUT(FTRP(PREV_BLKP(bp)), PACK(size, 0));
-       bp = PREV_BLKP(bp);
-
-    }
-
-    // Add the merged block to the explicit free list.
-    addblock(bp);
+    for (;;) {
+       prev_tag = PEEK(HDRP(bp) - WSIZE);
+       next_tag = PEEK(HDRP(next));
+       prev_size = (prev_tag & 0x1) ? 0 : TAG_SIZE(prev_tag);
+       next_size = (next_tag & 0x1) ? 0 : TAG_SIZE(next_tag);
+       prev = (char *)bp - prev_size;
+
+       // Lock every class involved in ascending order, so two threads can't deadlock.
+       mask = keep ? 0 : 1u << class_of(size + prev_size + next_size);
+       if (prev_size) {
+          mask |= 1u << class_of(prev_size);
+       }
+       if (next_size) {
+          mask |= 1u << class_of(next_size);
+       }
+       lock_classes(ar, mask);
+
+       // Free blocks only change while their class is locked, so if the tags still match they're good.
+       if (PEEK(HDRP(bp) - WSIZE) == prev_tag && PEEK(HDRP(next)) == next_tag
+           && (!prev_size || GET(HDRP(prev)) == prev_tag)
+           && (!next_size || GET(FTRP(next)) == next_tag)) {
+          break;
+       }
+       unlock_classes(ar, mask);
+    }
+
+    // The merged block is only known zero if every piece of it is.
+    if (prev_size || next_size) {
+       zero = flags & ZERO;
+       if (next_size) {
+          zero &= next_tag;
+          removeblock(next);
+       }
+       if (prev_size) {
+          zero &= prev_tag;
+          removeblock(prev);
+       }
+       if (zero) {
+          if (next_size) {
+             clear_seam(next);
+          }
+          if (prev_size) {
+             clear_seam(bp);
+          }
+       }
+       flags = zero;
+       bp = prev;
+       size += prev_size + next_size;
+    }
+
+    PUT(HDRP(bp), PACK(size, flags | (keep ? 1 : 0)));
+    PUT(FTRP(bp), PACK(size, flags | (keep ? 1 : 0)));
+    if (!keep) {
+       // Add the merged block to the free list for its size.
+       addblock(bp);
+    }
+    unlock_classes(ar, mask);
 
     return bp;
 }
 // $end coalesce
 
 /*
- * addblock - Add a block to the start of the free_listp explicit free list.
+ * free_block - Free a block for real: unmap it if it's mapped, otherwise coalesce it and put it in
+ *              the free list (or trim it off the end of the heap). What mm_free does without the cache.
+ */
+// $begin free_block
+static void free_block(void *bp)
+{
+    // Large blocks give their mapping back right away.
+    if (IS_MAPPED(HDRP(bp))) {
+       lock_heap();
+       mem_unmap((char *)bp - DSIZE);
+       unlock_heap();
+       return;
+    }
+
+    // Coalesce so that the freed memory ends up in the free lists in as big of a chunk as possible.
+    // If that made a big free block at the end of the heap, give some of it back.
+    bp = coalesce(bp, 1);
+    if (!trim_heap(bp)) {
+       list_block(bp);
+    }
+}
+// $end free_block
+
+/*
+ * remote_free - Push block bp on arena ar's remote free queue. Lock-free: any number of threads can
+ *               push at once, each with one compare-and-swap (more if it loses a race).
+ *               The arena's own threads drain it when they go to the free lists, but a thread that
+ *               lives on its caches may not for a long time, so the push that makes the queue
+ *               REMOTE_MAX long drains it right away.
+ */
+// $begin remote_free
+static void remote_free(char *ar, void *bp)
+{
+    char *head = __atomic_load_n(&ARENA_REMOTE(ar), __ATOMIC_RELAXED);
+
+    do {
+        NEXT_REMOTE(bp) = head;
+    } while (!__atomic_compare_exchange_n(&ARENA_REMOTE(ar), &head, (char *)bp, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_fetch_add(&remote_frees, 1, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&ARENA_NREMOTE(ar), 1, __ATOMIC_RELAXED) == REMOTE_MAX) {
+        enter();
+        remote_drain(ar);
+        leave();
+    }
+}
+// $end remote_free
+
+/*
+ * remote_drain - Take arena ar's whole remote free queue in one swap, and free every block on it.
+ *                Taking all of it at once means nothing is ever popped off the middle, so the
+ *                queue can't be fooled by a block that was freed, reused, and freed again (ABA).
+ */
+// $begin remote_drain
+static void remote_drain(char *ar)
+{
+    char *bp;
+    char *next;
+    size_t n = 0;
+
+    // Only a hint, but it keeps an empty queue from costing a swap on every malloc.
+    if (__atomic_load_n(&ARENA_REMOTE(ar), __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    bp = __atomic_exchange_n(&ARENA_REMOTE(ar), NULL, __ATOMIC_ACQUIRE);
+    if (bp == NULL) {
+        return;
+    }
+    __atomic_fetch_add(&remote_drains, 1, __ATOMIC_RELAXED);
+    for (; bp != NULL; bp = next) {
+        next = NEXT_REMOTE(bp);
+        free_block(bp);
+        n++;
+    }
+    __atomic_sub_fetch(&ARENA_NREMOTE(ar), n, __ATOMIC_RELAXED);
+}
+// $end remote_drain
+
+/*
+ * trim_heap - If free block bp is the last block in the heap and bigger than trim_threshold,
+ *             give all but TOP_PAD bytes of it back to memlib with a negative mem_sbrk.
+ *             The gap between the threshold and TOP_PAD keeps a heap that shrinks and then
+ *             grows a little from doing sbrk calls both ways every time.
+ *             If bp is a whole segment on its own, the segment goes back instead.
+ *             bp isn't in a free list yet. Returns 1 if trim_heap took care of it (what's left
+ *             of it is in a free list), or 0 if it's still up to the caller.
+ */
+// $begin trim_heap
+static int trim_heap(void *bp)
+{
+    char *ar;
+    size_t size = GET_SIZE(HDRP(bp));
+    size_t flags = GET_FLAGS(HDRP(bp));
+
+    // Only the block right before an epilogue can be trimmed. Both are hints without heap_lock.
+    if (TAG_SIZE(PEEK(HDRP(NEXT_BLKP(bp)))) != 0
+        || size < __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    // Between a prologue and an epilogue there's nothing else in the segment.
+    if ((char *)bp - SEGMENT_HEAD != heap_listp && GET(HDRP(bp) - WSIZE) == PACK(OVERHEAD, 1)) {
+        ar = SEG_ARENA((char *)bp - SEGMENT_HEAD);
+        lock_segs(ar);
+        release_segment(bp);
+        unlock_segs(ar);
+        __atomic_store_n(&trimmed, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    // Otherwise it has to be the end of the heap itself.
+    lock_heap();
+    if (HDRP(NEXT_BLKP(bp)) != (char *)mem_heap_hi() + 1 - WSIZE ||
+        mem_sbrk(-(intptr_t)(size - TOP_PAD)) == (void *)-1) {
+        unlock_heap();
+        return 0;
+    }
+    PUT(HDRP(bp), PACK(TOP_PAD, flags | 1));
+    PUT(FTRP(bp), PACK(TOP_PAD, flags | 1));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); // new epilogue header
+    __atomic_store_n(&trimmed, 1, __ATOMIC_RELAXED);
+    unlock_heap();
+
+    list_block(bp);
+    return 1;
+}
+// $end trim_heap
+
+/*
+ * clear_seam - Zero the words that end up in the middle of a payload when known zero
+ *              free block bp is merged onto the end of the free block in front of it:
+ *              the footer in front of bp, bp's header, and bp's free list pointers.
+ *              Keeps the merged block known zero.
+ */
+// $begin clear_seam
+static void clear_seam(void *bp)
+{
+    PUT((char *)bp - DSIZE, 0);
+    PUT(HDRP(bp), 0);
+    PUT(bp, 0);
+    PUT((char *)bp + WSIZE, 0);
+}
+// $end clear_seam
+
+/*
+ * clear_payload - Zero the first bytes of bp's payload for mm_calloc.
+ *                 Small blocks are cleared a word at a time inline (payloads are whole words),
+ *                 which beats the call overhead of memset. Big ones go to memset, which
+ *                 uses the widest stores the machine has.
+ */
+// $begin clear_payload
+static void clear_payload(void *bp, size_t bytes)
+{
+    size_t *p = bp;
+    size_t words = (bytes + (WSIZE-1)) / WSIZE;
+
+    if (words > 9) {
+       memset(bp, 0, words * WSIZE);
+       return;
+    }
+    while (words-- > 0) {
+       *p++ = 0;
+    }
+}
+// $end clear_payload
+
+/*
+ * compare_addr - qsort comparison for block pointers, lowest address first.
+ */
+// $begin compare_addr
+static int compare_addr(const void *a, const void *b)
+{
+    char *x = *(char * const *)a;
+    char *y = *(char * const *)b;
+
+    return (x > y) - (x < y);
+}
+// $end compare_addr
+
+/*
+ * addblock - Add a block to the start of the explicit free list for its size class in its arena.
  *            Adjusts the neighbor pointers so everything still is linked correctly.
+ *            The caller holds the class's lock.
  */
 // $begin addblock
 static void addblock(void *bp) {
-    NEXT_FREE_BLKP(bp) = free_listp;    // Point the new block's next free block to the start of the list.
-    PREV_FREE_BLKP(free_listp) = bp;    // Point the start of the list's previous free block to the new block.
+    char **listp = &ARENA_LISTS(arena_of(bp))[class_of(GET_SIZE(HDRP(bp)))];
+
+    NEXT_FREE_BLKP(bp) = *listp;        // Point the new block's next free block to the start of the list.
+    if (*listp != NULL) {
+        PREV_FREE_BLKP(*listp) = bp;    // Point the start of the list's previous free block to the new block.
+    }
     PREV_FREE_BLKP(bp) = NULL;          // Point the new block's previous free block to nothing.
-    free_listp = bp;                    // Set the new block as the start of the list.
+    __atomic_store_n(listp, bp, __ATOMIC_RELAXED); // Set the new block as the start of the list (find_fit peeks at it).
 }
 // $end addblock
 
 /*
- * removeblock - Remove a block from the free_listp explicit free list.
+ * removeblock - Remove a block from the explicit free list for its size class in its arena.
  *               Moves around some neighbor prev/next pointers so everything is still linked correctly.
+ *               The caller holds the class's lock.
  */
 // $begin removeblock
 static void removeblock(void *bp) {
@@ -476,23 +1703,687 @@ static void removeblock(void *bp) {
             //         [B] -> [C]
             NEXT_FREE_BLKP(PREV_FREE_BLKP(bp)) = NEXT_FREE_BLKP(bp);
         } else {
-            // If the block being removed doesn't have a previous free block, then it's the first block in free_listp.
-            // Set the free_listp to point to the next block after the one being removed.
+            // If the block being removed doesn't have a previous free block, then it's the first block in its list.
+            // Set the list head to point to the next block after the one being removed.
             // Ex: removeblock(A)
-            // Before: free_listp -> [A] -> [B]
-            // After:  free_listp -> [B]
-            //                [A] -> [B]
-            free_listp = NEXT_FREE_BLKP(bp);
+            // Before: head -> [A] -> [B]
+            // After:  head -> [B]
+            //          [A] -> [B]
+            __atomic_store_n(&ARENA_LISTS(arena_of(bp))[class_of(GET_SIZE(HDRP(bp)))], NEXT_FREE_BLKP(bp),
+                             __ATOMIC_RELAXED);
         }
         // Then point the next free block's previous free block pointer to the previous free block of the one being removed.
         // Ex: removeblock(B)
         // Before: [A] <- [B] <- [C]
         // After:  [A] <- [C]
         //         [A] <- [B]
-        PREV_FREE_BLKP(NEXT_FREE_BLKP(bp)) = PREV_FREE_BLKP(bp);
+        if(NEXT_FREE_BLKP(bp)) {
+            PREV_FREE_BLKP(NEXT_FREE_BLKP(bp)) = PREV_FREE_BLKP(bp);
+        }
 }
 // $end removeblock
 
+/*
+ * class_of - Return the size class of a block of size bytes.
+ */
+// $begin class_of
+static int class_of(size_t size)
+{
+    int c = 0;
+
+    while (c < NCLASSES-1 && size >= ((size_t)MINBLOCK << (c+1))) {
+        c++;
+    }
+    return c;
+}
+// $end class_of
+
+/*
+ * take_block - Take free block bp out of its free list for this thread to use, and mark it
+ *              allocated so nobody else touches it. The caller holds the class's lock.
+ *              The ZERO and PURGED flags stay, place and mm_calloc still need them.
+ */
+// $begin take_block
+static void take_block(void *bp)
+{
+    removeblock(bp);
+    PUT(HDRP(bp), GET(HDRP(bp)) | 0x1);
+    PUT(FTRP(bp), GET(HDRP(bp)));
+}
+// $end take_block
+
+/*
+ * list_block - Put block bp, which this thread has to itself, in the free list for its size.
+ */
+// $begin list_block
+static void list_block(void *bp)
+{
+    unsigned int mask = 1u << class_of(GET_SIZE(HDRP(bp)));
+    char *ar = arena_of(bp);
+
+    lock_classes(ar, mask);
+    PUT(HDRP(bp), GET(HDRP(bp)) & ~0x1);
+    PUT(FTRP(bp), GET(HDRP(bp)));
+    addblock(bp);
+    unlock_classes(ar, mask);
+}
+// $end list_block
+
+/*
+ * arena_of - Return the arena block bp belongs to: arena 0 if it's in the heap,
+ *            otherwise the one its segment was made for.
+ */
+// $begin arena_of
+static char *arena_of(void *bp)
+{
+    if ((char *)bp > heap_listp && (char *)bp <= (char *)mem_heap_hi()) {
+        return arenas;
+    }
+    return SEG_ARENA((size_t)bp & ~(size_t)(SEGMENT_SIZE-1));
+}
+// $end arena_of
+
+/*
+ * this_arena - Return the arena this thread allocates from right now.
+ */
+// $begin this_arena
+static char *this_arena(void)
+{
+    int cpu;
+
+    if (narenas == 1) {
+        return arenas;
+    }
+    if (arena_mode == MM_ARENA_CPU) {
+        cpu = sched_getcpu();
+        return arenas + ((cpu < 0) ? 0 : cpu % narenas) * ARENA_BYTES;
+    }
+    if (tarena == NULL || tarena_gen != heap_gen) {
+        tarena = arenas + (__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % narenas) * ARENA_BYTES;
+        tarena_gen = heap_gen;
+    }
+    return tarena;
+}
+// $end this_arena
+
+/*
+ * lock_classes - Lock the size classes of arena ar whose bits are set in mask, lowest class first.
+ *                Nothing to do if this thread already holds every lock (see lock_world).
+ */
+// $begin lock_classes
+static void lock_classes(char *ar, unsigned int mask)
+{
+    int c;
+
+    if (world_depth > 0) {
+        return;
+    }
+    for (c = 0; mask != 0; c++, mask >>= 1) {
+        if (mask & 1) {
+            pthread_mutex_lock(&ARENA_LOCKS(ar)[c]);
+        }
+    }
+}
+// $end lock_classes
+
+/*
+ * unlock_classes - Unlock the size classes of arena ar whose bits are set in mask.
+ */
+// $begin unlock_classes
+static void unlock_classes(char *ar, unsigned int mask)
+{
+    int c;
+
+    if (world_depth > 0) {
+        return;
+    }
+    for (c = 0; mask != 0; c++, mask >>= 1) {
+        if (mask & 1) {
+            pthread_mutex_unlock(&ARENA_LOCKS(ar)[c]);
+        }
+    }
+}
+// $end unlock_classes
+
+/*
+ * lock_heap, unlock_heap - Take and drop the heap lock. Never held while taking a class lock.
+ */
+// $begin lock_heap
+static void lock_heap(void)
+{
+    if (world_depth == 0) {
+        pthread_mutex_lock(heap_lock);
+    }
+}
+
+static void unlock_heap(void)
+{
+    if (world_depth == 0) {
+        pthread_mutex_unlock(heap_lock);
+    }
+}
+// $end lock_heap
+
+/*
+ * lock_segs, unlock_segs - Take and drop the lock on arena ar's segments: the heap lock for arena 0,
+ *                          whose segments are where the heap overflows to, or else ar's segment lock.
+ *                          Never held while taking a class lock or the heap lock.
+ */
+// $begin lock_segs
+static void lock_segs(char *ar)
+{
+    if (ar == arenas) {
+        lock_heap();
+    } else if (world_depth == 0) {
+        pthread_mutex_lock(ARENA_SEGLOCK(ar));
+    }
+}
+
+static void unlock_segs(char *ar)
+{
+    if (ar == arenas) {
+        unlock_heap();
+    } else if (world_depth == 0) {
+        pthread_mutex_unlock(ARENA_SEGLOCK(ar));
+    }
+}
+// $end lock_segs
+
+/*
+ * lock_world - Stop every other thread from getting into the allocator: take the big lock
+ *              with MM_LOCK_GLOBAL, or else the heap lock, every segment lock, and then every class lock
+ *              of every arena in order.
+ *              Calls nest, only the outermost one locks anything.
+ */
+// $begin lock_world
+static void lock_world(void)
+{
+    char *ar;
+    int c;
+
+    if (world_depth++ > 0) {
+        return;
+    }
+    if (locking == MM_LOCK_GLOBAL) {
+        pthread_mutex_lock(big_lock);
+        return;
+    }
+    pthread_mutex_lock(heap_lock);
+    for (ar = arenas + ARENA_BYTES; ar < arenas + narenas*ARENA_BYTES; ar += ARENA_BYTES) {
+        pthread_mutex_lock(ARENA_SEGLOCK(ar));
+    }
+    for (ar = arenas; ar < arenas + narenas*ARENA_BYTES; ar += ARENA_BYTES) {
+        for (c = 0; c < NCLASSES; c++) {
+            pthread_mutex_lock(&ARENA_LOCKS(ar)[c]);
+        }
+    }
+}
+
+static void unlock_world(void)
+{
+    char *ar;
+    int c;
+
+    if (--world_depth > 0) {
+        return;
+    }
+    if (locking == MM_LOCK_GLOBAL) {
+        pthread_mutex_unlock(big_lock);
+        return;
+    }
+    for (ar = arenas; ar < arenas + narenas*ARENA_BYTES; ar += ARENA_BYTES) {
+        for (c = NCLASSES-1; c >= 0; c--) {
+            pthread_mutex_unlock(&ARENA_LOCKS(ar)[c]);
+        }
+    }
+    for (ar = arenas + ARENA_BYTES; ar < arenas + narenas*ARENA_BYTES; ar += ARENA_BYTES) {
+        pthread_mutex_unlock(ARENA_SEGLOCK(ar));
+    }
+    pthread_mutex_unlock(heap_lock);
+}
+// $end lock_world
+
+/*
+ * enter, leave - Bracket every call into the allocator. They only lock anything with
+ *                MM_LOCK_GLOBAL, MM_LOCK_CLASS does its locking as it goes.
+ */
+// $begin enter
+static void enter(void)
+{
+    if (locking == MM_LOCK_GLOBAL) {
+        lock_world();
+    }
+}
+
+static void leave(void)
+{
+    if (locking == MM_LOCK_GLOBAL) {
+        unlock_world();
+    }
+}
+// $end enter
+
+/*
+ * cache_get - Take a block of exactly asize bytes out of this thread's cache, refilling the bin
+ *             if it's empty. Returns NULL if asize is too big to cache, or the caches are off.
+ */
+// $begin cache_get
+static void *cache_get(size_t asize)
+{
+    char *tc;
+    char *bp;
+    int bin = asize / DSIZE;
+
+    if (asize > CACHE_MAX || cache_high == 0 || (tc = this_cache()) == NULL) {
+        return NULL;
+    }
+    if ((bp = CACHE_HEAD(tc, bin)) == NULL) {
+        return cache_refill(tc, asize);
+    }
+    CACHE_HEAD(tc, bin) = NEXT_CACHED(bp);
+    CACHE_COUNT(tc, bin)--;
+    return bp;
+}
+// $end cache_get
+
+/*
+ * cache_put - Put block bp in this thread's cache, in the bin for blocks of size bytes (at most its
+ *             real size), flushing the bin down to cache_low if that puts it over cache_high.
+ *             Returns 0 if bp is too big to cache (or the caches are off).
+ */
+// $begin cache_put
+static int cache_put(void *bp, size_t size)
+{
+    char *tc;
+    int bin = size / DSIZE;
+
+    // Mapped blocks are always bigger than CACHE_MAX.
+    if (size > CACHE_MAX || cache_high == 0 || (tc = this_cache()) == NULL) {
+        return 0;
+    }
+    NEXT_CACHED(bp) = CACHE_HEAD(tc, bin);
+    CACHE_HEAD(tc, bin) = bp;
+    if (++CACHE_COUNT(tc, bin) > cache_high) {
+        cache_flush(tc, bin, cache_low);
+    }
+    return 1;
+}
+// $end cache_put
+
+/*
+ * this_cache - Return this thread's cache, making it the first time (or the first time since mm_init).
+ *              Returns NULL if there's no memory for one.
+ */
+// $begin this_cache
+static char *this_cache(void)
+{
+    size_t asize = adjust_size(CACHE_BYTES);
+    char *bp;
+
+    if (tcache != NULL && tcache_gen == heap_gen) {
+        return tcache;
+    }
+    tcache = NULL;
+    pthread_once(&cache_once, cache_key_init);
+
+    enter();
+    if ((bp = find_block(asize)) != NULL) {
+        place(bp, asize);
+    }
+    leave();
+    if (bp == NULL) {
+        return NULL;
+    }
+    memset(bp, 0, CACHE_BYTES);
+
+    tcache = bp;
+    tcache_gen = heap_gen;
+    pthread_setspecific(cache_key, bp);
+    return bp;
+}
+// $end this_cache
+
+/*
+ * cache_refill - Fill the empty bin for asize with cache_low blocks, all carved out of one free
+ *                block like mm_malloc_group does, and return one more for the caller.
+ */
+// $begin cache_refill
+static void *cache_refill(char *tc, size_t asize)
+{
+    size_t total = asize * (cache_low + 1);
+    int bin = asize / DSIZE;
+    char *bp;
+
+    enter();
+    if ((bp = find_block(total)) != NULL) {
+        place(bp, total);
+    }
+    leave();
+    if (bp == NULL) {
+        return NULL;
+    }
+
+    // The caller gets the last block, and whatever slack place left over with it.
+    total = GET_SIZE(HDRP(bp));
+    while (total - asize >= asize) {
+        PUT(HDRP(bp), PACK(asize, 1));
+        PUT(FTRP(bp), PACK(asize, 1));
+        NEXT_CACHED(bp) = CACHE_HEAD(tc, bin);
+        CACHE_HEAD(tc, bin) = bp;
+        CACHE_COUNT(tc, bin)++;
+        total -= asize;
+        bp = NEXT_BLKP(bp);
+    }
+    PUT(HDRP(bp), PACK(total, 1));
+    PUT(FTRP(bp), PACK(total, 1));
+    return bp;
+}
+// $end cache_refill
+
+/*
+ * cache_flush - Free the blocks in bin of cache tc until only keep are left.
+ */
+// $begin cache_flush
+static void cache_flush(char *tc, int bin, size_t keep)
+{
+    char *bp;
+
+    enter();
+    while (CACHE_COUNT(tc, bin) > keep) {
+        bp = CACHE_HEAD(tc, bin);
+        CACHE_HEAD(tc, bin) = NEXT_CACHED(bp);
+        CACHE_COUNT(tc, bin)--;
+        free_block(bp);
+    }
+    leave();
+}
+// $end cache_flush
+
+/*
+ * cache_drain - Free every block in this thread's cache, and then the cache.
+ */
+// $begin cache_drain
+static void cache_drain(void)
+{
+    char *tc = tcache;
+    int bin;
+
+    for (bin = 0; bin < CACHE_BINS; bin++) {
+        cache_flush(tc, bin, 0);
+    }
+    tcache = NULL;
+    pthread_setspecific(cache_key, NULL);
+    enter();
+    free_block(tc);
+    leave();
+}
+// $end cache_drain
+
+/*
+ * cache_exit - Drain an exiting thread's cache (the cache_key destructor), and its arena's remote
+ *              free queue, which it may not have looked at in a while.
+ *              A cache from before the last mm_init is already gone with the old heap.
+ */
+// $begin cache_exit
+static void cache_exit(void *tc)
+{
+    if (tc == tcache && tcache_gen == heap_gen) {
+        cache_drain();
+        enter();
+        remote_drain(this_arena());
+        leave();
+    }
+}
+
+static void cache_key_init(void)
+{
+    pthread_key_create(&cache_key, cache_exit);
+}
+// $end cache_exit
+
+/*
+ * pcpu_get - Take a block of exactly asize bytes out of the cache of the CPU this thread is on,
+ *            refilling the bin if it's empty. Returns NULL if asize is too big for the per-CPU
+ *            caches, or they're off.
+ */
+// $begin pcpu_get
+static void *pcpu_get(size_t asize)
+{
+    char *bin;
+    char *bp;
+
+    if (pcpu == NULL || asize > PCPU_MAX) {
+        return NULL;
+    }
+    bin = PCPU_BIN(asize / DSIZE);
+    if ((bp = rseq_pop(bin)) != NULL) {
+        return bp;
+    }
+    return pcpu_refill(bin, asize);
+}
+// $end pcpu_get
+
+/*
+ * pcpu_put - Put block bp in the cache of the CPU this thread is on, in the bin for blocks of size
+ *            bytes (at most its real size, like cache_put). A full bin gives half its
+ *            blocks back to the free lists first. Returns 0 if bp is too big for the per-CPU
+ *            caches (or they're off).
+ */
+// $begin pcpu_put
+static int pcpu_put(void *bp, size_t size)
+{
+    char *bin;
+    char *fp;
+    int i;
+
+    // Mapped blocks are always bigger than PCPU_MAX.
+    if (pcpu == NULL || size > PCPU_MAX) {
+        return 0;
+    }
+    bin = PCPU_BIN(size / DSIZE);
+    if (rseq_push(bin, bp)) {
+        return 1;
+    }
+
+    // This thread may be on another CPU by now, so it just frees whatever it pops.
+    enter();
+    for (i = 0; i < PCPU_CAP/2 && (fp = rseq_pop(bin)) != NULL; i++) {
+        free_block(fp);
+    }
+    leave();
+    return rseq_push(bin, bp);
+}
+// $end pcpu_put
+
+/*
+ * pcpu_refill - Fill bin (of this CPU's cache) with half its capacity of asize blocks, all carved
+ *               out of one free block like cache_refill does, and return one more for the caller.
+ *               Blocks that don't fit any more (another thread got there first) are freed.
+ */
+// $begin pcpu_refill
+static void *pcpu_refill(char *bin, size_t asize)
+{
+    size_t total = asize * (PCPU_CAP/2 + 1);
+    char *bp, *next, *last;
+
+    enter();
+    if ((bp = find_block(total)) != NULL) {
+        place(bp, total);
+    }
+    leave();
+    if (bp == NULL) {
+        return NULL;
+    }
+
+    // The caller gets the last block, and whatever slack place left over with it. They're all
+    // split up before any go in the bin, since the ones that don't fit are freed (and coalesced).
+    total = GET_SIZE(HDRP(bp));
+    for (last = bp; total - asize >= asize; last = NEXT_BLKP(last)) {
+        PUT(HDRP(last), PACK(asize, 1));
+        PUT(FTRP(last), PACK(asize, 1));
+        total -= asize;
+    }
+    PUT(HDRP(last), PACK(total, 1));
+    PUT(FTRP(last), PACK(total, 1));
+    for (; bp != last; bp = next) {
+        next = NEXT_BLKP(bp);
+        if (!rseq_push(bin, bp)) {
+            enter();
+            free_block(bp);
+            leave();
+        }
+    }
+    return last;
+}
+// $end pcpu_refill
+
+/*
+ * pcpu_flush - Free every block in every CPU's cache. A CPU's bins can only be popped from that CPU,
+ *              so the thread moves to each CPU in turn and empties them there, then goes back to the
+ *              CPUs it was allowed on before. A CPU the thread isn't allowed on keeps its blocks.
+ */
+// $begin pcpu_flush
+static void pcpu_flush(void)
+{
+    cpu_set_t allowed;
+    cpu_set_t one;
+    char *bp;
+    int cpu;
+    int i;
+
+    if (pcpu == NULL || sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return;
+    }
+    for (cpu = 0; cpu < ncpus && cpu < CPU_SETSIZE; cpu++) {
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (sched_setaffinity(0, sizeof(one), &one) < 0) {
+            continue;
+        }
+        for (i = 0; i < PCPU_BINS; i++) {
+            while ((bp = rseq_pop(PCPU_BIN(i))) != NULL) {
+                free_block(bp);
+            }
+        }
+    }
+    sched_setaffinity(0, sizeof(allowed), &allowed);
+}
+// $end pcpu_flush
+
+/*
+ * rseq_pop - Pop the top block off bin in the cache of the CPU this thread is running on, or
+ *            return NULL if it's empty. bin is the bin's address in the first CPU's cache.
+ *
+ * The pop is a restartable sequence: the kernel knows the critical section (from the descriptor
+ * in __rseq_cs) and sends the thread to the abort label if it's preempted, migrated, or signaled
+ * in the middle of it, so it starts over on whatever CPU it's on then. The store of the new
+ * count is the last instruction in the section, which is what makes the pop atomic without any
+ * lock or compare-and-swap.
+ */
+// $begin rseq_pop
+#ifdef HAVE_RSEQ
+static char *rseq_pop(char *bin)
+{
+    char *rs = (char *)__builtin_thread_pointer() + __rseq_offset;
+    char *bp;
+
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        ".Lrseq_cs%=:\n\t"
+        ".long 0, 0\n\t"                            // version, flags
+        ".quad .Lrseq_start%=, .Lrseq_commit%= - .Lrseq_start%=, .Lrseq_abort%=\n\t" // start, length, abort
+        ".popsection\n\t"
+        ".Lrseq_retry%=:\n\t"
+        "leaq .Lrseq_cs%=(%%rip), %%rax\n\t"
+        "movq %%rax, 8(%[rs])\n\t"                  // rseq->rseq_cs
+        ".Lrseq_start%=:\n\t"
+        "xorl %k[bp], %k[bp]\n\t"
+        "movl 4(%[rs]), %%eax\n\t"                  // rseq->cpu_id
+        "cmpl %[ncpus], %%eax\n\t"
+        "jae .Lrseq_commit%=\n\t"
+        "imulq %[stride], %%rax, %%rax\n\t"
+        "addq %[bin], %%rax\n\t"
+        "movq (%%rax), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz .Lrseq_commit%=\n\t"
+        "movq (%%rax,%%rcx,8), %[bp]\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t"                   // commit
+        ".Lrseq_commit%=:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".long 0x53053053\n\t"                      // RSEQ_SIG
+        ".Lrseq_abort%=:\n\t"
+        "jmp .Lrseq_retry%=\n\t"
+        ".popsection\n\t"
+        : [bp] "=&r" (bp)
+        : [rs] "r" (rs), [bin] "r" (bin), [ncpus] "r" (ncpus), [stride] "i" (PCPU_STRIDE)
+        : "rax", "rcx", "memory", "cc");
+    return bp;
+}
+#else
+static char *rseq_pop(char *bin)
+{
+    return NULL;
+}
+#endif
+// $end rseq_pop
+
+/*
+ * rseq_push - Push block bp on bin in the cache of the CPU this thread is running on, the same
+ *             way rseq_pop pops. Returns 0 if the bin is full.
+ */
+// $begin rseq_push
+#ifdef HAVE_RSEQ
+static int rseq_push(char *bin, void *bp)
+{
+    char *rs = (char *)__builtin_thread_pointer() + __rseq_offset;
+    int ok;
+
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        ".Lrseq_cs%=:\n\t"
+        ".long 0, 0\n\t"
+        ".quad .Lrseq_start%=, .Lrseq_commit%= - .Lrseq_start%=, .Lrseq_abort%=\n\t"
+        ".popsection\n\t"
+        ".Lrseq_retry%=:\n\t"
+        "leaq .Lrseq_cs%=(%%rip), %%rax\n\t"
+        "movq %%rax, 8(%[rs])\n\t"
+        ".Lrseq_start%=:\n\t"
+        "xorl %[ok], %[ok]\n\t"
+        "movl 4(%[rs]), %%eax\n\t"
+        "cmpl %[ncpus], %%eax\n\t"
+        "jae .Lrseq_commit%=\n\t"
+        "imulq %[stride], %%rax, %%rax\n\t"
+        "addq %[bin], %%rax\n\t"
+        "movq (%%rax), %%rcx\n\t"
+        "cmpq %[cap], %%rcx\n\t"
+        "jae .Lrseq_commit%=\n\t"
+        "movq %[bp], 8(%%rax,%%rcx,8)\n\t"
+        "incq %%rcx\n\t"
+        "movl $1, %[ok]\n\t"
+        "movq %%rcx, (%%rax)\n\t"                   // commit
+        ".Lrseq_commit%=:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".long 0x53053053\n\t"
+        ".Lrseq_abort%=:\n\t"
+        "jmp .Lrseq_retry%=\n\t"
+        ".popsection\n\t"
+        : [ok] "=&r" (ok)
+        : [rs] "r" (rs), [bin] "r" (bin), [bp] "r" (bp), [ncpus] "r" (ncpus),
+          [stride] "i" (PCPU_STRIDE), [cap] "i" (PCPU_CAP)
+        : "rax", "rcx", "memory", "cc");
+    return ok;
+}
+#else
+static int rseq_push(char *bin, void *bp)
+{
+    return 0;
+}
+#endif
+// $end rseq_push
+
 /*
  * printblock - Print the block's contents. This hasn't been modified from what was provided. Probably won't work.
  */
@@ -512,7 +2403,7 @@ static void printblock(void *bp)
        return;
     }
 
-    printf("%p: header: [%d:%c] footer: [%d:%c]\n", bp, hsize, (halloc ? 'a' : 'f'), fsize, (falloc ? 'a' : 'f')); 
+    printf("%p: header: [%zu:%c] footer: [%zu:%c]\n", bp, hsize, (halloc ? 'a' : 'f'), fsize, (falloc ? 'a' : 'f')); 
 }
 // $end printblock
 
@@ -3,7 +3,33 @@
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
+extern void mm_free_batch(void *ptrs[], size_t n);
+extern size_t mm_purge(void);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern int mm_malloc_group(size_t count, size_t sizes[], void *out_ptrs[]);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern size_t mm_usable_size(void *ptr);
+
+/* Locking modes for mm_set_locking */
+#define MM_LOCK_GLOBAL 0   /* one mutex around every call */
+#define MM_LOCK_CLASS  1   /* a mutex per size class, plus one for the heap (default) */
+extern void mm_set_locking(int mode);
+/* Blocks per thread cache bin for mm_set_cache, 0 for no caches */
+#define MM_CACHE_DEFAULT 16
+extern void mm_set_cache(size_t high);
+/* Per-CPU caches (rseq), returns 0 if they aren't available here */
+extern int mm_set_percpu(int on);
+
+/* Arena assignment modes for mm_set_arenas */
+#define MM_ARENA_RR    0   /* each new thread gets the next arena */
+#define MM_ARENA_CPU   1   /* each call uses the arena of the CPU it runs on */
+#define MM_ARENAS_MAX  64
+extern void mm_set_arenas(int n, int mode);
+extern void mm_set_remote(int on);
+extern void mm_remote_stats(long *frees, long *drains);
 
 
 /* 